@@ -1,6 +1,7 @@
 // based on cs3650 starter code
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "bitmap.h"
 
@@ -50,6 +51,205 @@ void bitmap_put(void *bm, int ii, int vv) {
 }
 
 
+// Everything past here works on whole longs. Bits are stored MSB first,
+// so bit ii of a word is (1UL << 63) >> ii and "from ii on" is ~0UL >> ii.
+// Long stretches of words are skipped or counted 256 bits at a time with
+// AVX2 when the CPU has it, picked at run time.
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BITMAP_AVX2
+#include <immintrin.h>
+#endif
+
+// bits [0, end % 64) of the word holding bit end - 1
+static unsigned long head_bits(int end) {
+    return (end % 64 != 0) ? ~(~0UL >> (end % 64)) : ~0UL;
+}
+
+#ifdef BITMAP_AVX2
+// 1 if the CPU has AVX2, -1 until someone asks. bitmap_test.c sets it to
+// check the word loops against the vector ones.
+static int have_avx2 = -1;
+
+static int use_avx2() {
+    if (have_avx2 < 0) {
+        have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return have_avx2;
+}
+
+__attribute__((target("avx2")))
+static long skip_words_avx2(const unsigned long *map, long word, long last, unsigned long fill) {
+    __m256i want = _mm256_set1_epi64x(fill);
+    while (word + 3 <= last) {
+        __m256i got = _mm256_loadu_si256((const __m256i *) (map + word));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(got, want)) != -1) {
+            break;
+        }
+        word += 4;
+    }
+    while (word <= last && map[word] == fill) {
+        word++;
+    }
+    return word;
+}
+
+// Popcount of a vector a nibble at a time, with a shuffle as the table.
+__attribute__((target("avx2")))
+static long count_words_avx2(const unsigned long *map, long word, long end) {
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i sums = _mm256_setzero_si256();
+    for (; word + 4 <= end; word += 4) {
+        __m256i vv = _mm256_loadu_si256((const __m256i *) (map + word));
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(vv, nibble));
+        __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(vv, 4), nibble));
+        sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    long count = _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+                 _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    for (; word < end; ++word) {
+        count += __builtin_popcountl(map[word]);
+    }
+    return count;
+}
+#endif
+
+// First word in [word, last] that isn't fill, or last + 1.
+static long skip_words(const unsigned long *map, long word, long last, unsigned long fill) {
+#ifdef BITMAP_AVX2
+    if (last - word >= 8 && use_avx2()) {
+        return skip_words_avx2(map, word, last, fill);
+    }
+#endif
+    while (word <= last && map[word] == fill) {
+        word++;
+    }
+    return word;
+}
+
+// How many bits are set in words [word, end).
+static long count_words(const unsigned long *map, long word, long end) {
+#ifdef BITMAP_AVX2
+    if (end - word >= 8 && use_avx2()) {
+        return count_words_avx2(map, word, end);
+    }
+#endif
+    long count = 0;
+    for (; word < end; ++word) {
+        count += __builtin_popcountl(map[word]);
+    }
+    return count;
+}
+
+// Index of the first 0 bit in [ii, size), or -1 if there isn't one.
+int bitmap_next_zero(void *bm, int ii, int size) {
+    unsigned long *map = (unsigned long *) bm;
+    if (ii >= size) {
+        return -1;
+    }
+
+    long word = ii / 64;
+    long lastWord = (size - 1) / 64;
+    // pretend everything before ii is taken
+    unsigned long taken = map[word] | ~(~0UL >> (ii % 64));
+    if (taken == ~0UL) {
+        word = skip_words(map, word + 1, lastWord, ~0UL);
+        if (word > lastWord) {
+            return -1;
+        }
+        taken = map[word];
+    }
+
+    int found = word * 64 + __builtin_clzl(~taken);
+    return found < size ? found : -1;
+}
+
+// Index of the first 1 bit in [ii, size), or -1 if there isn't one.
+int bitmap_next_one(void *bm, int ii, int size) {
+    unsigned long *map = (unsigned long *) bm;
+    if (ii >= size) {
+        return -1;
+    }
+
+    long word = ii / 64;
+    long lastWord = (size - 1) / 64;
+    unsigned long set = map[word] & (~0UL >> (ii % 64));
+    if (set == 0) {
+        word = skip_words(map, word + 1, lastWord, 0);
+        if (word > lastWord) {
+            return -1;
+        }
+        set = map[word];
+    }
+
+    int found = word * 64 + __builtin_clzl(set);
+    return found < size ? found : -1;
+}
+
+// Start of the first run of count 0 bits in [ii, size), or -1.
+int bitmap_next_zeros(void *bm, int ii, int size, int count) {
+    while ((ii = bitmap_next_zero(bm, ii, size)) != -1) {
+        if (ii + count > size) {
+            return -1;
+        }
+        int end = bitmap_next_one(bm, ii, ii + count);
+        if (end == -1) {
+            return ii;
+        }
+        ii = end;
+    }
+    return -1;
+}
+
+// How many bits in [ii, size) are 1.
+int bitmap_count(void *bm, int ii, int size) {
+    unsigned long *map = (unsigned long *) bm;
+    if (ii >= size) {
+        return 0;
+    }
+
+    long word = ii / 64;
+    long lastWord = (size - 1) / 64;
+    unsigned long first = ~0UL >> (ii % 64);
+    unsigned long last = head_bits(size);
+    if (word == lastWord) {
+        return __builtin_popcountl(map[word] & first & last);
+    }
+    return __builtin_popcountl(map[word] & first) + count_words(map, word + 1, lastWord) +
+           __builtin_popcountl(map[lastWord] & last);
+}
+
+static void put_bits(unsigned long *word, unsigned long mask, int vv) {
+    if (vv) {
+        *word |= mask;
+    } else {
+        *word &= ~mask;
+    }
+}
+
+// Sets bits [ii, ii + count) to vv.
+void bitmap_put_range(void *bm, int ii, int count, int vv) {
+    assert(vv == 0 || vv == 1);
+    unsigned long *map = (unsigned long *) bm;
+    if (count <= 0) {
+        return;
+    }
+
+    long word = ii / 64;
+    long lastWord = (ii + count - 1) / 64;
+    unsigned long first = ~0UL >> (ii % 64);
+    unsigned long last = head_bits(ii + count);
+    if (word == lastWord) {
+        put_bits(&map[word], first & last, vv);
+        return;
+    }
+    put_bits(&map[word], first, vv);
+    memset(&map[word + 1], vv ? 0xff : 0, (lastWord - word - 1) * sizeof(long));
+    put_bits(&map[lastWord], last, vv);
+}
+
 //size should be in bytes
 void bitmap_print(void *bm, int size) {
     unsigned long *map = (unsigned long *) bm;
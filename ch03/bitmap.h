@@ -7,6 +7,16 @@ int bitmap_get(void *bm, int ii);
 
 void bitmap_put(void *bm, int ii, int vv);
 
+int bitmap_next_zero(void *bm, int ii, int size);
+
+int bitmap_next_one(void *bm, int ii, int size);
+
+int bitmap_next_zeros(void *bm, int ii, int size, int count);
+
+int bitmap_count(void *bm, int ii, int size);
+
+void bitmap_put_range(void *bm, int ii, int count, int vv);
+
 void bitmap_print(void *bm, int size);
 
 #endif
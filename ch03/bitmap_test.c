@@ -0,0 +1,175 @@
+// Checks the word-at-a-time bitmap functions against one bit at a time
+// versions built on bitmap_get / bitmap_put, with and without AVX2.
+//
+//   make bitmap_test && ./bitmap_test         check
+//   ./bitmap_test bench                       check, then time both paths
+//
+// It includes bitmap.c itself to get at have_avx2.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.c"
+
+// big enough that the vector loops get long stretches of words
+#define TEST_BITS (64 * 1024 + 37)
+#define TEST_WORDS (TEST_BITS / 64 + 2)
+
+static int failures = 0;
+
+static void check(int ok, const char *what, int ii, int size, int count) {
+    if (!ok) {
+        failures++;
+        if (failures <= 20) {
+            fprintf(stderr, "FAIL: %s (ii %d, size %d, count %d)\n", what, ii, size, count);
+        }
+    }
+}
+
+static int ref_count(void *bm, int ii, int size) {
+    int count = 0;
+    for (; ii < size; ++ii) {
+        count += bitmap_get(bm, ii);
+    }
+    return count;
+}
+
+static int ref_next_zeros(void *bm, int ii, int size, int count) {
+    int run = 0;
+    for (; ii < size; ++ii) {
+        run = bitmap_get(bm, ii) ? 0 : run + 1;
+        if (run == count) {
+            return ii - count + 1;
+        }
+    }
+    return -1;
+}
+
+static void ref_put_range(void *bm, int ii, int count, int vv) {
+    for (int end = ii + count; ii < end; ++ii) {
+        bitmap_put(bm, ii, vv);
+    }
+}
+
+// Random runs of 0s and 1s, some of them many words long, so there's
+// something to skip and every kind of word boundary comes up.
+static void fill_runs(unsigned long *map, int bits) {
+    memset(map, 0, TEST_WORDS * sizeof(long));
+    int ii = 0;
+    int vv = rand() % 2;
+    while (ii < bits) {
+        int len = (rand() % 4 == 0) ? rand() % 3000 : rand() % 70;
+        ref_put_range(map, ii, (ii + len > bits) ? bits - ii : len, vv);
+        ii += len + 1;
+        vv = !vv;
+    }
+}
+
+// A start and end that are often on, or one either side of, a word edge.
+static int pick(int most) {
+    int ii = rand() % (most + 1);
+    switch (rand() % 4) {
+    case 0:
+        ii -= ii % 64;
+        break;
+    case 1:
+        ii = ii - ii % 64 + 63;
+        break;
+    }
+    return (ii > most) ? most : ii;
+}
+
+static void run_checks() {
+    static unsigned long map[TEST_WORDS];
+    static unsigned long want[TEST_WORDS];
+    for (int round = 0; round < 300; ++round) {
+        // the size is the page count: bits past it are set, and mustn't count
+        int size = TEST_BITS - rand() % 200;
+        fill_runs(map, TEST_BITS);
+        ref_put_range(map, size, TEST_WORDS * 64 - size, 1);
+
+        for (int jj = 0; jj < 50; ++jj) {
+            int ii = pick(size);
+            int end = ii + pick(size - ii);
+            int count = 1 + rand() % ((rand() % 4 == 0) ? 2000 : 100);
+
+            check(bitmap_count(map, ii, end) == ref_count(map, ii, end), "count", ii, end, 0);
+            check(bitmap_next_zeros(map, ii, size, count) == ref_next_zeros(map, ii, size, count),
+                  "next_zeros", ii, size, count);
+            check(bitmap_next_zero(map, ii, size) == ref_next_zeros(map, ii, size, 1),
+                  "next_zero", ii, size, 1);
+
+            int vv = rand() % 2;
+            memcpy(want, map, sizeof(map));
+            bitmap_put_range(map, ii, end - ii, vv);
+            ref_put_range(want, ii, end - ii, vv);
+            check(memcmp(map, want, sizeof(map)) == 0, "put_range", ii, end, vv);
+        }
+    }
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// A mostly full map, like a page bitmap on a busy image, with the free
+// bits near the end.
+static void run_bench(const char *name) {
+    static unsigned long map[(1 << 24) / 64];
+    int size = 1 << 24;
+    memset(map, 0xff, sizeof(map));
+    bitmap_put_range(map, size - 5000, 3000, 0);
+
+    int reps = 200;
+    double t0 = now_ns();
+    long sum = 0;
+    for (int ii = 0; ii < reps; ++ii) {
+        sum += bitmap_count(map, ii, size);
+    }
+    double t1 = now_ns();
+    for (int ii = 0; ii < reps; ++ii) {
+        sum += bitmap_next_zeros(map, ii, size, 1000);
+    }
+    double t2 = now_ns();
+    for (int ii = 0; ii < reps; ++ii) {
+        bitmap_put_range(map, 1 + ii, size / 2, ii % 2);
+    }
+    double t3 = now_ns();
+    printf("%-5s count %8.0f us   next_zeros %8.0f us   put_range %8.0f us   (%ld)\n", name,
+           (t1 - t0) / reps / 1000, (t2 - t1) / reps / 1000, (t3 - t2) / reps / 1000, sum);
+}
+
+int main(int argc, char **argv) {
+    int bench = (argc > 1 && strcmp(argv[1], "bench") == 0);
+    srand(3650);
+
+#ifdef BITMAP_AVX2
+    int avx2 = use_avx2();
+    have_avx2 = 0;
+    run_checks();
+    if (bench) {
+        run_bench("words");
+    }
+    if (avx2) {
+        have_avx2 = 1;
+        run_checks();
+        if (bench) {
+            run_bench("avx2");
+        }
+    } else {
+        printf("no AVX2 here, only the word loops were checked\n");
+    }
+#else
+    run_checks();
+    if (bench) {
+        run_bench("words");
+    }
+#endif
+
+    printf("%s\n", failures ? "bitmap test FAILED" : "bitmap test ok");
+    return failures != 0;
+}
@@ -0,0 +1,190 @@
+// Path -> inode number cache.
+//
+// A fixed table of DCACHE_SIZE entries, chained off a hash table, with the
+// least recently used entry reused when it's full. inum is -1 for a path
+// we know isn't there. Paths too long for an entry just aren't cached.
+
+#include <string.h>
+#include <pthread.h>
+#include "dcache.h"
+#include "directory.h"
+#include "util.h"
+
+#define DCACHE_BUCKETS (DCACHE_SIZE * 2)
+
+typedef struct dentry {
+    char path[DCACHE_PATH];
+    int inum;
+    uint32_t hash;
+    int used;
+    int next;       // next entry in the bucket, or -1
+    int lru_prev;   // towards the most recently used
+    int lru_next;   // towards the least recently used
+} dentry;
+
+static dentry dcache[DCACHE_SIZE];
+static int buckets[DCACHE_BUCKETS];
+static int lru_head = -1;   // most recently used
+static int lru_tail = -1;   // least recently used
+static int dcache_ready = 0;
+static unsigned dcache_gen = 0;    // bumped whenever a name changes
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dcache_init() {
+    for (int ii = 0; ii < DCACHE_BUCKETS; ++ii) {
+        buckets[ii] = -1;
+    }
+    // every entry starts out free, on the LRU list ready to be taken
+    for (int ii = 0; ii < DCACHE_SIZE; ++ii) {
+        dcache[ii].used = 0;
+        dcache[ii].lru_prev = ii - 1;
+        dcache[ii].lru_next = (ii + 1 < DCACHE_SIZE) ? ii + 1 : -1;
+    }
+    lru_head = 0;
+    lru_tail = DCACHE_SIZE - 1;
+    dcache_ready = 1;
+}
+
+static void lru_unlink(int ii) {
+    dentry *de = &dcache[ii];
+    if (de->lru_prev >= 0) {
+        dcache[de->lru_prev].lru_next = de->lru_next;
+    } else {
+        lru_head = de->lru_next;
+    }
+    if (de->lru_next >= 0) {
+        dcache[de->lru_next].lru_prev = de->lru_prev;
+    } else {
+        lru_tail = de->lru_prev;
+    }
+}
+
+static void lru_push_head(int ii) {
+    dcache[ii].lru_prev = -1;
+    dcache[ii].lru_next = lru_head;
+    if (lru_head >= 0) {
+        dcache[lru_head].lru_prev = ii;
+    }
+    lru_head = ii;
+    if (lru_tail < 0) {
+        lru_tail = ii;
+    }
+}
+
+static void lru_push_tail(int ii) {
+    dcache[ii].lru_next = -1;
+    dcache[ii].lru_prev = lru_tail;
+    if (lru_tail >= 0) {
+        dcache[lru_tail].lru_next = ii;
+    }
+    lru_tail = ii;
+    if (lru_head < 0) {
+        lru_head = ii;
+    }
+}
+
+// Take entry ii out of its bucket and make it the next one to reuse.
+static void dcache_drop(int ii) {
+    dentry *de = &dcache[ii];
+    int *link = &buckets[de->hash % DCACHE_BUCKETS];
+    while (*link != ii) {
+        link = &dcache[*link].next;
+    }
+    *link = de->next;
+    de->used = 0;
+    lru_unlink(ii);
+    lru_push_tail(ii);
+}
+
+static int dcache_find(const char *path, uint32_t hash) {
+    for (int ii = buckets[hash % DCACHE_BUCKETS]; ii >= 0; ii = dcache[ii].next) {
+        if (dcache[ii].hash == hash && streq(dcache[ii].path, path)) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+// Returns 1 and sets *inum (-1 for a negative entry) on a hit. On a miss
+// returns 0 and sets *gen for dcache_fill().
+int dcache_lookup(const char *path, int *inum, unsigned *gen) {
+    pthread_mutex_lock(&dcache_lock);
+    *gen = dcache_gen;
+    int ii = dcache_ready ? dcache_find(path, directory_hash(path)) : -1;
+    if (ii >= 0) {
+        lru_unlink(ii);
+        lru_push_head(ii);
+        *inum = dcache[ii].inum;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+    return ii >= 0;
+}
+
+static void dcache_put(const char *path, int inum) {
+    if (strlen(path) >= DCACHE_PATH) {
+        return;
+    }
+    if (!dcache_ready) {
+        dcache_init();
+    }
+    uint32_t hash = directory_hash(path);
+    int ii = dcache_find(path, hash);
+    if (ii < 0) {
+        ii = lru_tail;
+        if (dcache[ii].used) {
+            dcache_drop(ii);
+        }
+        dentry *de = &dcache[ii];
+        strcpy(de->path, path);
+        de->hash = hash;
+        de->used = 1;
+        de->next = buckets[hash % DCACHE_BUCKETS];
+        buckets[hash % DCACHE_BUCKETS] = ii;
+    }
+    dcache[ii].inum = inum;
+    lru_unlink(ii);
+    lru_push_head(ii);
+}
+
+// Cache the result of a walk that started at generation gen.
+void dcache_fill(const char *path, int inum, unsigned gen) {
+    pthread_mutex_lock(&dcache_lock);
+    if (gen == dcache_gen) {
+        dcache_put(path, inum);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Record that path now names inum (-1 if it's gone).
+void dcache_insert(const char *path, int inum) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    dcache_put(path, inum);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_invalidate(const char *path) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    int ii = dcache_ready ? dcache_find(path, directory_hash(path)) : -1;
+    if (ii >= 0) {
+        dcache_drop(ii);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+// Drop path and everything cached below it. Used when a directory moves,
+// so this walks the whole table.
+void dcache_invalidate_tree(const char *path) {
+    pthread_mutex_lock(&dcache_lock);
+    dcache_gen++;
+    int nn = strlen(path);
+    for (int ii = 0; dcache_ready && ii < DCACHE_SIZE; ++ii) {
+        dentry *de = &dcache[ii];
+        if (de->used && strncmp(de->path, path, nn) == 0
+            && (de->path[nn] == 0 || de->path[nn] == '/')) {
+            dcache_drop(ii);
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
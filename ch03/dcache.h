@@ -0,0 +1,27 @@
+// Cache of path -> inode number lookups.
+//
+// Failed lookups are cached too, as negative entries. Anything that adds,
+// removes or moves a name has to invalidate it here, while it still holds
+// the directory's lock.
+//
+// A lookup that misses gets the cache's generation back, and fills in what
+// it found with dcache_fill(). That's dropped if the names changed in the
+// meantime, so a walk that raced with an unlink can't cache a stale answer.
+
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#define DCACHE_SIZE 4096
+#define DCACHE_PATH 256
+
+int dcache_lookup(const char *path, int *inum, unsigned *gen);
+
+void dcache_fill(const char *path, int inum, unsigned gen);
+
+void dcache_insert(const char *path, int inum);
+
+void dcache_invalidate(const char *path);
+
+void dcache_invalidate_tree(const char *path);
+
+#endif
@@ -4,6 +4,9 @@
 #define DIR_NAME 48
 
 #include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/stat.h>
 #include "directory.h"
 #include "util.h"
 #include <errno.h>
@@ -11,96 +14,244 @@
 #include "pages.h"
 #include "inode.h"
 #include "bitmap.h"
+#include "trace.h"
+#include "stats.h"
 
 
-/*typedef struct dirent {
-    char name[DIR_NAME];
-    int  inum;
-    char _reserved[12];
-} dirent;*/
+// A directory is hashed, htree style. Page 0 of the directory is the root
+// of an index of (hash, page) pairs sorted by hash, and every entry whose
+// name hashes into [entries[ii].hash, entries[ii + 1].hash) lives under
+// that one page. The index starts as just the root pointing at leaves and
+// grows extra levels as the root fills up, so the directory can grow as big
+// as a file. Entry 0 of the root always starts at hash 0. Entries with the
+// same hash are never split across leaves, so a lookup only ever probes
+// one leaf.
 
 static const int MAX_DIR_ENTRIES = 4096 / sizeof(dirent);
 
+// physical page holding the directory's ii'th page
+static int dir_pnum(inode *dd, int ii) {
+    return inode_get_pnum(dd, ii);
+}
+
+static dx_node *dir_node(inode *dd, int block) {
+    return (dx_node *) pages_get_page(dir_pnum(dd, block));
+}
+
+static dirent *dir_leaf(inode *dd, int block) {
+    return (dirent *) pages_get_page(dir_pnum(dd, block));
+}
+
+// FNV-1a over the first len bytes of name
+static uint32_t hash_bytes(const char *name, int len) {
+    uint32_t hh = 2166136261u;
+    for (int ii = 0; ii < len; ++ii) {
+        hh ^= (unsigned char) name[ii];
+        hh *= 16777619u;
+    }
+    return hh;
+}
+
+uint32_t directory_hash(const char *name) {
+    return hash_bytes(name, strlen(name));
+}
+
+// index of the entry in node covering hash
+static int dx_find(dx_node *node, uint32_t hash) {
+    int lo = 0;
+    int hi = node->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (node->entries[mid].hash <= hash) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+// Walk down the index to the leaf for hash and return its page. If blocks
+// isn't NULL, the index pages and the entry taken in each are filled in
+// from the root down, and the number of index levels is returned in *levels.
+static int dx_probe(inode *dd, uint32_t hash, int *blocks, int *idxs, int *levels) {
+    dx_node *node = dir_node(dd, 0);
+    int block = 0;
+    if (levels) {
+        *levels = node->levels;
+    }
+    for (int lvl = 0;; ++lvl) {
+        int idx = dx_find(node, hash);
+        if (blocks) {
+            blocks[lvl] = block;
+            idxs[lvl] = idx;
+        }
+        block = node->entries[idx].block;
+        if (node->levels == 0) {
+            return block;
+        }
+        node = dir_node(dd, block);
+    }
+}
+
+// Add a zeroed page at the end of the directory.
+// Returns its page number in the directory, or -1.
+static int dir_new_page(inode *dd) {
+    int block = bytes_to_pages(dd->size);
+    if (grow_inode(dd, dd->size + 4096) < 0) {
+        return -1;
+    }
+    return block;
+}
+
+// Add an empty leaf page at the end of the directory.
+static int dir_new_leaf(inode *dd) {
+    int block = dir_new_page(dd);
+    if (block < 0) {
+        return -1;
+    }
+    dirent *leaf = dir_leaf(dd, block);
+    for (int i = 0; i < MAX_DIR_ENTRIES; ++i) {
+        leaf[i].inum = -1;
+    }
+    return block;
+}
+
+// Put (hash, block) in node right after entry idx. The node has room.
+static void dx_insert(dx_node *node, int idx, uint32_t hash, int block) {
+    memmove(&node->entries[idx + 2], &node->entries[idx + 1],
+            (node->count - idx - 1) * sizeof(dx_entry));
+    node->entries[idx + 1].hash = hash;
+    node->entries[idx + 1].block = block;
+    node->count++;
+}
+
+// Make sure the bottom index node on the way to hash has room for one
+// more leaf. Full nodes are split top down, one page at a time, so the
+// index is whole if we run out of space part way. When the root itself is
+// full its entries move down into a new page and the index gets a level
+// deeper. Returns 0, or -1 if there's no room.
+static int dx_make_room(inode *dd, uint32_t hash) {
+    for (;;) {
+        int blocks[DX_MAX_LEVELS + 1];
+        int idxs[DX_MAX_LEVELS + 1];
+        int levels;
+        dx_probe(dd, hash, blocks, idxs, &levels);
+
+        // highest level from which every node down to the bottom is full
+        int top = levels + 1;
+        while (top > 0 && dir_node(dd, blocks[top - 1])->count == DX_ENTRIES) {
+            top--;
+        }
+        if (top == levels + 1) {
+            return 0;
+        }
+
+        if (top == 0 && levels == DX_MAX_LEVELS) {
+            return -1;
+        }
+        int block = dir_new_page(dd);
+        if (block < 0) {
+            return -1;
+        }
+        dx_node *node = dir_node(dd, blocks[top]);
+        dx_node *fresh = dir_node(dd, block);
+        if (top == 0) {
+            memcpy(fresh, node, sizeof(dx_node));
+            node->count = 1;
+            node->levels++;
+            node->entries[0].hash = 0;
+            node->entries[0].block = block;
+        } else {
+            int half = node->count / 2;
+            fresh->count = node->count - half;
+            fresh->levels = node->levels;
+            memcpy(fresh->entries, node->entries + half, fresh->count * sizeof(dx_entry));
+            node->count = half;
+            dx_insert(dir_node(dd, blocks[top - 1]), idxs[top - 1],
+                      fresh->entries[0].hash, block);
+        }
+    }
+}
+
+// Set up an empty directory: the index root and one leaf for every hash.
+int directory_setup(inode *dd) {
+    if (grow_inode(dd, 4096) < 0) {
+        return -1;
+    }
+    dx_node *root = dir_node(dd, 0);
+    root->count = 1;
+    root->levels = 0;
+    root->entries[0].hash = 0;
+    root->entries[0].block = dir_new_leaf(dd);
+    if (root->entries[0].block < 0) {
+        shrink_inode(dd, 0);
+        return -1;
+    }
+    return 0;
+}
+
 
 void directory_init() {
-    inode *inodes = (inode *) pages_get_page(1);
+    inode *inodes = get_inode(0);
     if (inodes[0].refs == 1) {
 //        puts("directory already init'd");
         return;
     }
 
     struct timespec ts;
-    int rv = clock_getres(CLOCK_REALTIME, &ts);
-
+    int rv = clock_gettime(CLOCK_REALTIME, &ts);
     if (rv < 0) {
         return;
     }
 
     //Root node can never be deleted
+    int rootNum = alloc_inode();
+    assert(rootNum == 0);
     inodes[0].refs = 1;
     inodes[0].mode = 040755;
-    inodes[0].size = 4096;
-    inodes[0].ptrs[0] = alloc_page();
-    inodes[0].ptrs[1] = 0;
-    inodes[0].iptr = 0;
-    inodes[0].last_change = ts.tv_sec;
-    inodes[0].last_view = ts.tv_sec;
-    inodes[0].creation_time = ts.tv_sec;
-
-
-    bitmap_put(get_inode_bitmap(), 0, 1);
-    bitmap_put(get_pages_bitmap(), inodes[0].ptrs[0], 1);
-
-    // mark all entries in this directory as empty/unset
-    void *datapg = pages_get_page(inodes[0].ptrs[0]);
-    dirent *cur = (dirent *) datapg;
-    for (int i = 0; i < MAX_DIR_ENTRIES; ++i) {
-        cur[i].inum = -1;
-    }
+    inodes[0].size = 0;
+    inodes[0].flags = 0;
+    inodes[0].pages = 0;
+    inodes[0].depth = 0;
+    inodes[0].nexts = 0;
+    inodes[0].last_change = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    inodes[0].last_view = inodes[0].last_change;
+    inodes[0].creation_time = inodes[0].last_change;
+
+    rv = directory_setup(&inodes[0]);
+    assert(rv == 0);
 }
 
-int directory_lookup_page(void *entryPage, const char *name) {
-    dirent *cur = (dirent *) entryPage;
-    int cntr = 0;
-    while (cntr < MAX_DIR_ENTRIES) {
-        if (cur->inum != -1 && streq(cur->name, name)) {
+// Returns the slot in the leaf holding the len byte name, or -1
+static int directory_lookup_leaf(dirent *cur, const char *name, int len, uint32_t hash) {
+    for (int cntr = 0; cntr < MAX_DIR_ENTRIES; ++cntr) {
+        if (cur[cntr].inum != -1 && cur[cntr].hash == hash
+            && strncmp(cur[cntr].name, name, len) == 0 && cur[cntr].name[len] == 0) {
             return cntr;
         }
-        cur++;
-        cntr++;
     }
     return -1;
 }
 
-// Returns the index in the directory
-int directory_lookup(inode *dd, const char *name) {
-    // Look in first direct page
-    int pgRes = directory_lookup_page(pages_get_page(dd->ptrs[0]), name);
-    if (pgRes == -1 && dd->size >= (4096 * 2)) {
-        //Didn't find in first direct page, check second
-        pgRes = directory_lookup_page(pages_get_page(dd->ptrs[1]), name);
-        if (pgRes != -1) {
-            return MAX_DIR_ENTRIES + pgRes;
-        }
+// Returns the inode of the len byte name in the directory, or -1
+static int directory_lookup_len(inode *dd, const char *name, int len) {
+    if (len >= DIR_NAME) {
+        return -1;
+    }
+    uint32_t hash = hash_bytes(name, len);
+    dirent *leaf = dir_leaf(dd, dx_probe(dd, hash, NULL, NULL, NULL));
+    int slot = directory_lookup_leaf(leaf, name, len, hash);
+    stats_dir_probe((slot == -1) ? MAX_DIR_ENTRIES : slot + 1);
+    if (slot == -1) {
+        return -1;
     }
-    return pgRes;
+    return leaf[slot].inum;
 }
 
 // Returns the inode of the item in the directory, or -1
 int directory_lookup_inode(inode *dd, const char *name) {
-    // Look in first direct page
-    int pgRes = directory_lookup_page(pages_get_page(dd->ptrs[0]), name);
-    if (pgRes != -1) {
-        return ((dirent *) pages_get_page(dd->ptrs[0]))[pgRes].inum;
-    }
-    if (dd->size >= (4096 * 2)) {
-        //Didn't find in first direct page, check second
-        pgRes = directory_lookup_page(pages_get_page(dd->ptrs[1]), name);
-        if (pgRes != -1) {
-            return ((dirent *) pages_get_page(dd->ptrs[1]))[pgRes].inum;
-        }
-    }
-    return pgRes;
+    return directory_lookup_len(dd, name, strlen(name));
 }
 
 
@@ -108,176 +259,196 @@ int directory_lookup_inode(inode *dd, const char *name) {
 //int tree_lookup(const char* path);
 
 
-int directory_put_page(int dataPgIdx, const char *name, int inum) {
-    void *dataPgPtr = pages_get_page(dataPgIdx);
-    dirent *cur = (dirent *) dataPgPtr;
-    int cntr = 0;
-    int spotFound = 0;
-    while (cntr < MAX_DIR_ENTRIES) {
-        if (cur->inum == -1 /*|| cur->inum == 0*/) {
-            strcpy(cur->name, name);
-            cur->inum = inum;
-            return cntr;
-        }
-        cur++;
-        cntr++;
-    }
-    return -1;
+static int dirent_cmp(const void *aa, const void *bb) {
+    uint32_t ha = ((const dirent *) aa)->hash;
+    uint32_t hb = ((const dirent *) bb)->hash;
+    return (ha > hb) - (ha < hb);
 }
 
-// Returns the index where we put it in the directory
-int directory_put(inode *dd, const char *name, int inum) {
-    int tryPg = directory_put_page(dd->ptrs[0], name, inum);
-    if (tryPg == -1 && dd->size <= 4096  /*&& dd->ptrs[1]==0*/) { //this was a ?
-        dd->ptrs[1] = alloc_page();
-
-        // mark all entries in this directory as empty/unset
-        void *datapg = pages_get_page(dd->ptrs[1]);
-        dirent *cur = (dirent *) datapg;
-        for (int i = 0; i < MAX_DIR_ENTRIES; ++i) {
-            cur[i].inum = -1;
+// Split the full leaf for hash in two at a hash boundary as close to the
+// middle as we can get. Returns 0, or -1 if there's no room or every name
+// in the leaf has the same hash.
+static int dir_split(inode *dd, uint32_t hash) {
+    if (dx_make_room(dd, hash) < 0) {
+        return -1;
+    }
+    int blocks[DX_MAX_LEVELS + 1];
+    int idxs[DX_MAX_LEVELS + 1];
+    int levels;
+    dirent *leaf = dir_leaf(dd, dx_probe(dd, hash, blocks, idxs, &levels));
+
+    dirent tmp[MAX_DIR_ENTRIES];
+    memcpy(tmp, leaf, sizeof(tmp));
+    qsort(tmp, MAX_DIR_ENTRIES, sizeof(dirent), dirent_cmp);
+
+    int half = MAX_DIR_ENTRIES / 2;
+    int split = -1;
+    for (int off = 0; off < half && split < 0; ++off) {
+        if (tmp[half + off].hash != tmp[half + off - 1].hash) {
+            split = half + off;
+        } else if (tmp[half - off].hash != tmp[half - off - 1].hash) {
+            split = half - off;
         }
+    }
+    if (split < 0) {
+        return -1;
+    }
 
-
-        dd->size += 4096;
+    int block = dir_new_leaf(dd);
+    if (block < 0) {
+        return -1;
     }
-    if (tryPg == -1 && dd->size >= (4096 * 2)) {
-        tryPg = directory_put_page(dd->ptrs[1], name, inum);
-        if (tryPg == -1) {
-            return -1;
-        } else {
-            return MAX_DIR_ENTRIES + tryPg;
-        }
+    dirent *upper = dir_leaf(dd, block);
+    memcpy(upper, tmp + split, (MAX_DIR_ENTRIES - split) * sizeof(dirent));
+    memcpy(leaf, tmp, split * sizeof(dirent));
+    for (int i = split; i < MAX_DIR_ENTRIES; ++i) {
+        leaf[i].inum = -1;
     }
-    return tryPg;
+
+    dx_insert(dir_node(dd, blocks[levels]), idxs[levels], tmp[split].hash, block);
+    return 0;
 }
 
-int directory_delete_page(int dataPgIdx, const char *name) {
-    void *dataPgPtr = pages_get_page(dataPgIdx);
-    dirent *cur = (dirent *) dataPgPtr;
-    int oldINum = -1;
-    int cntr = 0;
-    while (cntr < MAX_DIR_ENTRIES) {
-        if (cur->inum != -1 && streq(cur->name, name)) {
-            oldINum = cur->inum;
-            cur->inum = -1;
-            break;
+// Returns the slot we put it in within its leaf, or -1
+int directory_put(inode *dd, const char *name, int inum) {
+    if (strlen(name) >= DIR_NAME) {
+        return -1;
+    }
+    uint32_t hash = directory_hash(name);
+    for (;;) {
+        dirent *cur = dir_leaf(dd, dx_probe(dd, hash, NULL, NULL, NULL));
+        for (int cntr = 0; cntr < MAX_DIR_ENTRIES; ++cntr) {
+            if (cur[cntr].inum == -1) {
+                strcpy(cur[cntr].name, name);
+                cur[cntr].inum = inum;
+                cur[cntr].hash = hash;
+                return cntr;
+            }
+        }
+        // leaf is full, split it and go again
+        if (dir_split(dd, hash) < 0) {
+            return -1;
         }
-        cur++;
-        cntr++;
     }
-    return oldINum;
 }
 
-// delete the corresponding entry (no leading /) from the directory datapage
+// delete the corresponding entry (no leading /) from the directory
 // returns the inode number. -1 if wasn't found
 int directory_delete(inode *dd, const char *name) {
-    int PAGE_SIZE = 4096;
-
-    int tryPg1 = directory_delete_page(dd->ptrs[0], name);
-    if (tryPg1 == -1 && dd->size >= (PAGE_SIZE * 2)) {
-        return directory_delete_page(dd->ptrs[1], name);
+    uint32_t hash = directory_hash(name);
+    dirent *leaf = dir_leaf(dd, dx_probe(dd, hash, NULL, NULL, NULL));
+    int slot = directory_lookup_leaf(leaf, name, strlen(name), hash);
+    if (slot == -1) {
+        return -1;
     }
-    return tryPg1;
+    int oldINum = leaf[slot].inum;
+    leaf[slot].inum = -1;
+    return oldINum;
 }
 
 
-// Adds to input slist* the list for the given dir page
-slist *directory_list_page(slist *list, int dataPgIdx) {
-    void *dataPgPtr = pages_get_page(dataPgIdx);
-    dirent *cur = (dirent *) dataPgPtr;
-    int cntr = 0;
-    while (cntr < MAX_DIR_ENTRIES) {
-        if (/*cur->inum != 0 && */cur->inum != -1) {
-            printf("inum = %d . added |%s| to list\n", cur->inum, cur->name);
-            list = s_cons(cur->name, list);
+// Walk path from the root one component at a time, in place, holding
+// each directory's lock only while looking in it. Returns
+// the inode number path names, or -ENOENT if it isn't there and -ENOTDIR
+// if something on the way isn't a directory. If parent isn't NULL it gets
+// the directory that holds (or would hold) the last component, or -1 if
+// that doesn't exist either, and *leaf points at the last component in
+// path. For "/" the parent is the root itself and *leaf is NULL.
+int directory_walk(const char *path, int *parent, const char **leaf) {
+    int cur = 0;
+    int up = 0;
+    const char *name = NULL;
+    const char *pp = path;
+
+    for (;;) {
+        while (*pp == '/') {
+            pp++;
+        }
+        if (*pp == 0) {
+            break;
+        }
+        const char *end = pp;
+        while (*end != 0 && *end != '/') {
+            end++;
         }
-        cntr++;
-        cur++;
-    }
-    return list;
-}
-
-
-// from https://www.tutorialspoint.com/c_standard_library/c_function_strtok.htm
-// This gets the inode of the last item in path
-inode *pathToDir(const char *path) {
-    slist *p = s_split(path, '/');
-    inode *rootDir = (inode *) pages_get_page(1);
-    inode *cur = rootDir;
-    inode *prev = rootDir;
 
-    if (streq(p->data, "")) {
-        p = p->next;
-    }
-    while (p != NULL) {
-        //printf("Looking for |%s|\n", p->data);
-        int dirIdx = directory_lookup(cur, p->data);
-        void *dirData = NULL;
-        if (dirIdx < MAX_DIR_ENTRIES) {
-            dirData = pages_get_page(cur->ptrs[0]);
-        } else {
-            dirData = pages_get_page(cur->ptrs[1]);
-            dirIdx -= MAX_DIR_ENTRIES; //indx in 2nd pg
+        if (cur < 0) {
+            // a directory on the way is missing
+            up = -1;
+            break;
+        }
+        inode *dd = get_inode(cur);
+        if (!S_ISDIR(dd->mode)) {
+            cur = -ENOTDIR;
+            up = -1;
+            break;
+        }
+        up = cur;
+        name = pp;
+        inode_rdlock(dd);
+        cur = directory_lookup_len(dd, pp, end - pp);
+        inode_unlock(dd);
+        if (cur == -1) {
+            cur = -ENOENT;
         }
-        dirent *curEntries = (dirent *) dirData;
-        //printf("found entry --- %s\n", curEntries[dirIdx].name);
-        int inodeNum = curEntries[dirIdx].inum;
-        prev = cur;
-        cur = /*rootDir*/ ((inode *) pages_get_page(1)) + inodeNum; // use the inode page!
-        print_inode(cur);
-        p = p->next;
+        pp = end;
+    }
+
+    if (parent != NULL) {
+        *parent = up;
+        *leaf = name;
     }
     return cur;
 }
 
 
-//i know this is almost identical to above. just want to see if it works
-//abstraction later....
-//This function gets the inode the contains the last item
-inode *pathToLastItemContainer(const char *path) {
-    slist *p = s_split(path, '/');
-    inode *rootDir = (inode *) pages_get_page(1);
-    inode *cur = rootDir;
-    inode *prev = rootDir;
-
-    if (streq(p->data, "")) {
-        p = p->next;
-    }
-    while (p != NULL) {
-        //printf("Looking for |%s|\n", p->data);
-        int dirIdx = directory_lookup(cur, p->data);
-        void *dirData = NULL;
-        if (dirIdx < MAX_DIR_ENTRIES) {
-            dirData = pages_get_page(cur->ptrs[0]);
+// Calls fn on every entry under index page block, in hash order, until
+// it returns something other than 0, which is passed back.
+static int directory_each_node(inode *dd, int block, directory_fn fn, void *arg) {
+    dx_node *node = dir_node(dd, block);
+    for (int ii = 0; ii < node->count; ++ii) {
+        int rv = 0;
+        if (node->levels > 0) {
+            rv = directory_each_node(dd, node->entries[ii].block, fn, arg);
         } else {
-            dirData = pages_get_page(cur->ptrs[1]);
-            dirIdx -= MAX_DIR_ENTRIES; //indx in 2nd pg
+            dirent *cur = dir_leaf(dd, node->entries[ii].block);
+            for (int cntr = 0; cntr < MAX_DIR_ENTRIES && rv == 0; ++cntr) {
+                if (cur[cntr].inum != -1) {
+                    rv = fn(arg, cur[cntr].name, cur[cntr].inum);
+                }
+            }
+        }
+        if (rv != 0) {
+            return rv;
         }
-        dirent *curEntries = (dirent *) dirData;
-        //printf("found entry --- %s\n", curEntries[dirIdx].name);
-        int inodeNum = curEntries[dirIdx].inum;
-        prev = cur;
-        cur = /*rootDir*/ ((inode *) pages_get_page(1)) + inodeNum; //use inode page
-        print_inode(cur);
-        p = p->next;
     }
-    return prev;
+    return 0;
 }
 
+int directory_each(inode *dd, directory_fn fn, void *arg) {
+    return directory_each_node(dd, 0, fn, arg);
+}
+
+static int list_one(void *arg, const char *name, int inum) {
+    slist **list = arg;
+    TRACE(TR_DIR, TR_DEBUG, "inum = %d . added |%s| to list", inum, name);
+    *list = s_cons(name, *list);
+    return 0;
+}
 
-// Lists directory
-slist *directory_list(const char *path) {
-    //printf("making directory list for path: %s\n", path);
-    inode *dirptr = pathToDir(path);
-    //inode* dirptr = (inode*)pages_get_page(1);
+// Lists directory, NULL if it's empty
+slist *directory_list(inode *dd) {
     slist *out = NULL; //keep like this
-    out = directory_list_page(out, dirptr->ptrs[0]);
-    if (dirptr->size >= (2 * 4096)) {
-        out = directory_list_page(out, dirptr->ptrs[1]);
-    }
+    directory_each(dd, list_one, &out);
     return out;
 }
 
-//void print_directory(inode* dd);
+static int found_one(void *arg, const char *name, int inum) {
+    return 1;
+}
 
+int directory_is_empty(inode *dd) {
+    return directory_each(dd, found_one, NULL) == 0;
+}
+
+//void print_directory(inode* dd);
@@ -5,6 +5,7 @@
 
 #define DIR_NAME 48
 
+#include <stdint.h>
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
@@ -14,13 +15,38 @@
 typedef struct dirent {
     char name[DIR_NAME];
     int inum;
-    char _reserved[12];
+    uint32_t hash; // directory_hash(name)
+    char _reserved[8];
 } dirent;
 
+_Static_assert(sizeof(dirent) == 64, "64 dirents to a page");
+
+// one entry of an index node
+typedef struct dx_entry {
+    uint32_t hash;  // lowest name hash under this entry
+    int block;      // page number within the directory it points to
+} dx_entry;
+
+#define DX_ENTRIES 511
+#define DX_MAX_LEVELS 3
+
+// an index page; the root is page 0 of the directory
+typedef struct dx_node {
+    int count;
+    int levels;     // index levels below this one, 0 if entries are leaves
+    dx_entry entries[DX_ENTRIES];
+} dx_node;
+
+_Static_assert(sizeof(dx_node) == 4096, "an index node fills one page");
+
 void directory_init();
 
-int directory_lookup(inode *dd, const char *name);
+int directory_setup(inode *dd);
 
+uint32_t directory_hash(const char *name);
+
+// The caller holds the directory's lock for these: a read lock for
+// lookups, a write lock to change it.
 int directory_lookup_inode(inode *dd, const char *name);
 
 //int tree_lookup(const char* path);
@@ -28,9 +54,16 @@ int directory_put(inode *dd, const char *name, int inum);
 
 int directory_delete(inode *dd, const char *name);
 
-slist *directory_list(const char *path);
+// called for each entry; anything but 0 stops the walk
+typedef int (*directory_fn)(void *arg, const char *name, int inum);
+
+int directory_each(inode *dd, directory_fn fn, void *arg);
+
+slist *directory_list(inode *dd);
+
+int directory_is_empty(inode *dd);
 
-inode *pathToLastItemContainer(const char *path);
+int directory_walk(const char *path, int *parent, const char **leaf);
 //void print_directory(inode* dd);
 
 #endif
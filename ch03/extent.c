@@ -0,0 +1,397 @@
+#include <string.h>
+#include <assert.h>
+
+#include "extent.h"
+#include "pages.h"
+
+// A tree page: the same header as the root in the inode, with room for
+// as many records as fit in the rest of the page.
+typedef struct extent_node {
+    int depth; // 0 for leaves, whose records are extents
+    int count;
+    extent recs[(4096 - 2 * sizeof(int)) / sizeof(extent)];
+} extent_node;
+
+// Index records reuse extent: fpn is the lowest file page under the child
+// and pnum is the child's page. len and flags are unused.
+typedef struct ext_view {
+    int *depth;
+    int *count;
+    extent *recs;
+    int cap;
+} ext_view;
+
+static ext_view root_view(inode *node) {
+    ext_view v = {&node->depth, &node->nexts, node->ext, INODE_EXTENTS};
+    return v;
+}
+
+static ext_view page_view(int pnum) {
+    extent_node *pg = (extent_node *) pages_get_page(pnum);
+    ext_view v = {&pg->depth, &pg->count, pg->recs, sizeof(pg->recs) / sizeof(extent)};
+    return v;
+}
+
+// Index of the last record starting at or before fpn, -1 if there's none.
+static int find_rec(ext_view v, int fpn) {
+    int lo = 0;
+    int hi = *v.count - 1;
+    int found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (v.recs[mid].fpn <= fpn) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// Physical page holding file page fpn, or 0 if it isn't mapped.
+// The extent it came from is copied to *out if out isn't NULL.
+int extent_lookup(inode *node, int fpn, extent *out) {
+    ext_view v = root_view(node);
+    while (*v.depth > 0) {
+        int ii = find_rec(v, fpn);
+        if (ii < 0) {
+            return 0;
+        }
+        v = page_view(v.recs[ii].pnum);
+    }
+
+    int ii = find_rec(v, fpn);
+    if (ii < 0 || fpn >= v.recs[ii].fpn + v.recs[ii].len) {
+        return 0;
+    }
+    if (out != NULL) {
+        *out = v.recs[ii];
+    }
+    return v.recs[ii].pnum + (fpn - v.recs[ii].fpn);
+}
+
+static int next_at(ext_view v, int fpn) {
+    int ii = find_rec(v, fpn);
+    if (ii < 0) {
+        ii = 0;
+    }
+    for (; ii < *v.count; ++ii) {
+        if (*v.depth > 0) {
+            int found = next_at(page_view(v.recs[ii].pnum), fpn);
+            if (found >= 0) {
+                return found;
+            }
+        } else if (v.recs[ii].fpn + v.recs[ii].len > fpn) {
+            return (v.recs[ii].fpn > fpn) ? v.recs[ii].fpn : fpn;
+        }
+    }
+    return -1;
+}
+
+// The first mapped file page at or after fpn, or -1 if there isn't one.
+int extent_next(inode *node, int fpn) {
+    return next_at(root_view(node), fpn);
+}
+
+// One past the last mapped file page, or 0 if nothing is mapped.
+int extent_end(inode *node) {
+    ext_view v = root_view(node);
+    while (*v.depth > 0 && *v.count > 0) {
+        v = page_view(v.recs[*v.count - 1].pnum);
+    }
+    if (*v.count == 0) {
+        return 0;
+    }
+    extent *last = &v.recs[*v.count - 1];
+    return last->fpn + last->len;
+}
+
+// The leaf record that maps fpn, or NULL. Its leaf and position there go
+// in *leaf and *at.
+static extent *find_extent(inode *node, int fpn, ext_view *leaf, int *at) {
+    ext_view v = root_view(node);
+    while (*v.depth > 0) {
+        int ii = find_rec(v, fpn);
+        if (ii < 0) {
+            return NULL;
+        }
+        v = page_view(v.recs[ii].pnum);
+    }
+    int ii = find_rec(v, fpn);
+    if (ii < 0 || fpn >= v.recs[ii].fpn + v.recs[ii].len) {
+        return NULL;
+    }
+    *leaf = v;
+    *at = ii;
+    return &v.recs[ii];
+}
+
+// Pages for the splits an insert might do, got before it changes anything
+// so running out can't leave the tree half split. A tree this wide never
+// gets anywhere near this deep.
+#define SPLITS_MAX 16
+
+typedef struct split_pages {
+    int pnums[SPLITS_MAX];
+    int count;
+} split_pages;
+
+// Puts rec at position at, splitting the node in two when it's full.
+// Returns the page of the new right half (and its first file page in
+// *splitFpn), or 0 if there was room.
+static int add_rec(ext_view v, int at, extent rec, int *splitFpn, split_pages *spare) {
+    if (*v.count < v.cap) {
+        memmove(v.recs + at + 1, v.recs + at, (*v.count - at) * sizeof(extent));
+        v.recs[at] = rec;
+        (*v.count)++;
+        return 0;
+    }
+
+    assert(spare->count > 0);
+    int sib = spare->pnums[--spare->count];
+    ext_view s = page_view(sib);
+    int half = *v.count / 2;
+    *s.depth = *v.depth;
+    *s.count = *v.count - half;
+    memcpy(s.recs, v.recs + half, *s.count * sizeof(extent));
+    *v.count = half;
+
+    if (at <= half) {
+        add_rec(v, at, rec, NULL, spare);
+    } else {
+        add_rec(s, at - half, rec, NULL, spare);
+    }
+    *splitFpn = s.recs[0].fpn;
+    return sib;
+}
+
+static int insert_at(ext_view v, extent rec, int *splitFpn, split_pages *spare) {
+    int ii = find_rec(v, rec.fpn);
+
+    if (*v.depth > 0) {
+        if (ii < 0) {
+            // goes before everything, so this child's lower bound drops
+            ii = 0;
+            v.recs[0].fpn = rec.fpn;
+        }
+        int childFpn;
+        int sib = insert_at(page_view(v.recs[ii].pnum), rec, &childFpn, spare);
+        if (sib == 0) {
+            return 0;
+        }
+        extent idx = {childFpn, sib, 0, 0};
+        return add_rec(v, ii + 1, idx, splitFpn, spare);
+    }
+
+    // extend a neighbour when the new pages carry straight on from it
+    if (ii >= 0) {
+        extent *prev = &v.recs[ii];
+        if (prev->fpn + prev->len == rec.fpn && prev->pnum + prev->len == rec.pnum &&
+            prev->flags == rec.flags) {
+            prev->len += rec.len;
+            return 0;
+        }
+        if (ii + 1 < *v.count) {
+            extent *next = &v.recs[ii + 1];
+            if (rec.fpn + rec.len == next->fpn && rec.pnum + rec.len == next->pnum &&
+                rec.flags == next->flags) {
+                next->fpn = rec.fpn;
+                next->pnum = rec.pnum;
+                next->len += rec.len;
+                return 0;
+            }
+        }
+    }
+    return add_rec(v, ii + 1, rec, splitFpn, spare);
+}
+
+// How many pages inserting at fpn could take: one for each full node on
+// the way down that has only full nodes under it, and one more to move
+// the root out when that's all of them.
+static int splits_needed(ext_view v, int fpn) {
+    int full = 0;
+    int levels = 0;
+    while (1) {
+        full = (*v.count < v.cap) ? 0 : full + 1;
+        levels++;
+        if (*v.depth == 0) {
+            break;
+        }
+        int ii = find_rec(v, fpn);
+        v = page_view(v.recs[(ii < 0) ? 0 : ii].pnum);
+    }
+    return (full == levels) ? full + 1 : full;
+}
+
+// Map file pages [fpn, fpn + len) to physical pages [pnum, pnum + len).
+// The range must not already be mapped. Returns 0, or -1 if the tree
+// needed a page and there wasn't one.
+int extent_insert(inode *node, int fpn, int pnum, int len, int flags) {
+    extent rec = {fpn, pnum, len, flags};
+    ext_view root = root_view(node);
+
+    split_pages spare = {{0}, 0};
+    int want = splits_needed(root, fpn);
+    assert(want <= SPLITS_MAX);
+    while (spare.count < want) {
+        int pg = alloc_page();
+        if (pg < 0) {
+            while (spare.count > 0) {
+                free_page(spare.pnums[--spare.count]);
+            }
+            return -1;
+        }
+        spare.pnums[spare.count++] = pg;
+    }
+
+    int splitFpn;
+    int sib = insert_at(root, rec, &splitFpn, &spare);
+    if (sib == 0) {
+        // what a merge with a neighbour didn't need goes back
+        while (spare.count > 0) {
+            free_page(spare.pnums[--spare.count]);
+        }
+        return 0;
+    }
+
+    // The root split: what stayed in the inode moves to its own page and
+    // the inode becomes an index over the two halves.
+    assert(spare.count == 1);
+    int left = spare.pnums[0];
+    ext_view l = page_view(left);
+    *l.depth = *root.depth;
+    *l.count = *root.count;
+    memcpy(l.recs, root.recs, *root.count * sizeof(extent));
+
+    (*root.depth)++;
+    *root.count = 2;
+    extent lo = {l.recs[0].fpn, left, 0, 0};
+    extent hi = {splitFpn, sib, 0, 0};
+    root.recs[0] = lo;
+    root.recs[1] = hi;
+    return 0;
+}
+
+// Clear EXT_UNWRITTEN on file pages [fpn, fpn + len), splitting records
+// where only part of one was written. Every page in the range has to be
+// mapped. Returns 0, or -1 if a split needed a tree page it couldn't get.
+int extent_mark_written(inode *node, int fpn, int len) {
+    int end = fpn + len;
+    ext_view leaf;
+    int at;
+    while (fpn < end) {
+        extent *rec = find_extent(node, fpn, &leaf, &at);
+        assert(rec != NULL);
+        extent old = *rec;
+        int stop = (old.fpn + old.len < end) ? old.fpn + old.len : end;
+        if (!(old.flags & EXT_UNWRITTEN)) {
+            fpn = stop;
+            continue;
+        }
+
+        // Add the pieces after old.fpn first and cut old down last, so a
+        // failed insert leaves the range as it was. Lookups pick the later
+        // records over old in the meantime.
+        int off = stop - old.fpn;
+        if (stop < old.fpn + old.len &&
+            extent_insert(node, stop, old.pnum + off, old.len - off, EXT_UNWRITTEN) < 0) {
+            return -1;
+        }
+        int rv = 0;
+        if (fpn > old.fpn) {
+            off = fpn - old.fpn;
+            rv = extent_insert(node, fpn, old.pnum + off, stop - fpn, 0);
+        }
+        // inserts can split leaves, so old may have moved
+        rec = find_extent(node, old.fpn, &leaf, &at);
+        if (rv < 0) {
+            // old keeps the middle, still unwritten
+            rec->len = stop - old.fpn;
+            return -1;
+        }
+        if (fpn > old.fpn) {
+            rec->len = fpn - old.fpn;
+        } else {
+            rec->len = stop - old.fpn;
+            rec->flags &= ~EXT_UNWRITTEN;
+
+            // Writing into preallocated space in order eats the unwritten
+            // record from the front. Fold each bite into the written one
+            // before it, or there'd be a record per write.
+            extent *prev = (at > 0) ? &leaf.recs[at - 1] : NULL;
+            if (prev != NULL && prev->flags == 0 && prev->fpn + prev->len == rec->fpn &&
+                prev->pnum + prev->len == rec->pnum) {
+                prev->len += rec->len;
+                memmove(rec, rec + 1, (*leaf.count - at - 1) * sizeof(extent));
+                (*leaf.count)--;
+            }
+        }
+        fpn = stop;
+    }
+    return 0;
+}
+
+// Frees every page at or after fpn under v, along with tree pages that
+// end up empty, by way of pb. Returns how many file pages went.
+static int truncate_at(ext_view v, int fpn, page_batch *pb) {
+    int keep = *v.count;
+    int freed = 0;
+    for (int ii = *v.count - 1; ii >= 0; --ii) {
+        extent *rec = &v.recs[ii];
+
+        if (*v.depth > 0) {
+            ext_view child = page_view(rec->pnum);
+            freed += truncate_at(child, fpn, pb);
+            if (*child.count > 0) {
+                break;
+            }
+            free_batch_add(pb, rec->pnum, 1);
+            keep = ii;
+            continue;
+        }
+
+        if (rec->fpn >= fpn) {
+            free_batch_add(pb, rec->pnum, rec->len);
+            freed += rec->len;
+            keep = ii;
+        } else {
+            if (rec->fpn + rec->len > fpn) {
+                int cut = fpn - rec->fpn;
+                free_batch_add(pb, rec->pnum + cut, rec->len - cut);
+                freed += rec->len - cut;
+                rec->len = cut;
+            }
+            break;
+        }
+    }
+    *v.count = keep;
+    return freed;
+}
+
+// Unmap and free file pages from fpn onwards. Only the records past fpn
+// are visited, so holes cost nothing. Returns how many file pages went.
+int extent_truncate(inode *node, int fpn) {
+    ext_view root = root_view(node);
+    page_batch pb = {0};
+    int freed = truncate_at(root, fpn, &pb);
+
+    // pull the tree back into the inode while it fits there
+    while (*root.depth > 0 && *root.count <= 1) {
+        if (*root.count == 0) {
+            *root.depth = 0;
+            break;
+        }
+        int only = root.recs[0].pnum;
+        ext_view child = page_view(only);
+        if (*child.count > root.cap) {
+            break;
+        }
+        *root.depth = *child.depth;
+        *root.count = *child.count;
+        memcpy(root.recs, child.recs, *child.count * sizeof(extent));
+        free_batch_add(&pb, only, 1);
+    }
+    free_batch_flush(&pb);
+    return freed;
+}
@@ -0,0 +1,24 @@
+// Extent tree that maps file pages to physical pages for an inode.
+//
+// The first INODE_EXTENTS records live in the inode itself. Once they
+// overflow, the records move out to tree pages and the inode becomes the
+// root of a B+tree keyed on file page number.
+
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "inode.h"
+
+int extent_lookup(inode *node, int fpn, extent *out);
+
+int extent_next(inode *node, int fpn);
+
+int extent_end(inode *node);
+
+int extent_insert(inode *node, int fpn, int pnum, int len, int flags);
+
+int extent_mark_written(inode *node, int fpn, int len);
+
+int extent_truncate(inode *node, int fpn);
+
+#endif
@@ -0,0 +1,84 @@
+// Open file handles, numbered from 1 so an fh of 0 is never one of ours.
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "handle.h"
+
+static handle **handles; // slot fh - 1, NULL when free
+static int handles_cap = 0;
+static int handles_hint = 0; // next-fit cursor for handle_open()
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t handle_open(int inum, int flags) {
+    handle *hh = calloc(1, sizeof(handle));
+    assert(hh != NULL);
+    hh->inum = inum;
+    hh->flags = flags;
+    pthread_mutex_init(&hh->lock, NULL);
+
+    pthread_mutex_lock(&handles_lock);
+    int slot = -1;
+    for (int ii = 0; ii < handles_cap; ++ii) {
+        int jj = (handles_hint + ii) % handles_cap;
+        if (handles[jj] == NULL) {
+            slot = jj;
+            break;
+        }
+    }
+    if (slot < 0) {
+        // full, double it
+        int cap = (handles_cap == 0) ? 64 : handles_cap * 2;
+        handles = realloc(handles, cap * sizeof(handle *));
+        assert(handles != NULL);
+        memset(handles + handles_cap, 0, (cap - handles_cap) * sizeof(handle *));
+        slot = handles_cap;
+        handles_cap = cap;
+    }
+    handles[slot] = hh;
+    handles_hint = slot + 1;
+    pthread_mutex_unlock(&handles_lock);
+    return slot + 1;
+}
+
+// The handle behind fh, or NULL if it isn't open.
+handle *handle_get(uint64_t fh) {
+    handle *hh = NULL;
+    pthread_mutex_lock(&handles_lock);
+    if (fh > 0 && fh <= handles_cap) {
+        hh = handles[fh - 1];
+    }
+    pthread_mutex_unlock(&handles_lock);
+    return hh;
+}
+
+void handle_close(uint64_t fh) {
+    pthread_mutex_lock(&handles_lock);
+    handle *hh = NULL;
+    if (fh > 0 && fh <= handles_cap) {
+        hh = handles[fh - 1];
+        handles[fh - 1] = NULL;
+    }
+    pthread_mutex_unlock(&handles_lock);
+
+    if (hh != NULL) {
+        pthread_mutex_destroy(&hh->lock);
+        free(hh);
+    }
+}
+
+// Reads and writes on one handle can run at the same time, so each works
+// on its own copy of the cursor and puts it back when done.
+inode_cursor handle_cursor(handle *hh) {
+    pthread_mutex_lock(&hh->lock);
+    inode_cursor cur = hh->cur;
+    pthread_mutex_unlock(&hh->lock);
+    return cur;
+}
+
+void handle_set_cursor(handle *hh, inode_cursor cur) {
+    pthread_mutex_lock(&hh->lock);
+    hh->cur = cur;
+    pthread_mutex_unlock(&hh->lock);
+}
@@ -0,0 +1,32 @@
+// Open file handles.
+//
+// open() resolves the file once and gets back a number for
+// fuse_file_info.fh, and every read and write after that goes straight to
+// the inode through it.
+
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "inode.h"
+
+typedef struct handle {
+    int inum;
+    int flags; // open(2) flags
+    pthread_mutex_t lock; // guards cur
+    inode_cursor cur; // where the last read or write on this handle ended up
+} handle;
+
+uint64_t handle_open(int inum, int flags);
+
+handle *handle_get(uint64_t fh);
+
+void handle_close(uint64_t fh);
+
+inode_cursor handle_cursor(handle *hh);
+
+void handle_set_cursor(handle *hh, inode_cursor cur);
+
+#endif
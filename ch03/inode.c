@@ -1,24 +1,430 @@
 #include "inode.h"
 #include "pages.h"
 #include "assert.h"
+#include "util.h"
+#include "extent.h"
+#include "bitmap.h"
+#include "trace.h"
+#include <string.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 
-void print_inode(inode *node) {
-    printf("inode -- refs: %d, mode: %d, size: %d, ptrs[%d, %d], iptr: %d\n",
-           node->refs, node->mode, node->size, node->ptrs[0], node->ptrs[1], node->iptr);
+static int inode_hint = 0; // next-fit cursor for alloc_inode()
+
+// Covers the inode bitmap, inode_hint and the inode table fields in the
+// superblock. May take the page allocator's lock, never the other way.
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Reader/writer locks for the inodes themselves, picked by address.
+// Inodes never move, so the pointer is as good as the number.
+#define INODE_LOCKS 1024
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = {
+        [0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+static int inode_lock_for(inode *node) {
+    return ((uintptr_t) node / sizeof(inode)) % INODE_LOCKS;
+}
+
+// Bumped under the write lock whenever pages are taken away from an inode
+// sharing that lock, which is what makes an inode_cursor stale. New pages
+// don't matter, extents only ever get longer.
+static unsigned inode_map_gens[INODE_LOCKS];
+
+void inode_rdlock(inode *node) {
+    pthread_rwlock_rdlock(&inode_locks[inode_lock_for(node)]);
+}
+
+void inode_wrlock(inode *node) {
+    pthread_rwlock_wrlock(&inode_locks[inode_lock_for(node)]);
+}
+
+// Like inode_wrlock(), but gives up at once if the lock is taken, which
+// includes by the calling thread. Returns 0 if it got it.
+int inode_trywrlock(inode *node) {
+    return pthread_rwlock_trywrlock(&inode_locks[inode_lock_for(node)]);
+}
+
+void inode_unlock(inode *node) {
+    pthread_rwlock_unlock(&inode_locks[inode_lock_for(node)]);
+}
+
+// Write lock two inodes in a fixed order. They may share a lock, in which
+// case it's only taken once.
+void inode_wrlock2(inode *aa, inode *bb) {
+    int la = inode_lock_for(aa);
+    int lb = inode_lock_for(bb);
+    pthread_rwlock_wrlock(&inode_locks[min(la, lb)]);
+    if (la != lb) {
+        pthread_rwlock_wrlock(&inode_locks[max(la, lb)]);
+    }
+}
+
+void inode_unlock2(inode *aa, inode *bb) {
+    int la = inode_lock_for(aa);
+    int lb = inode_lock_for(bb);
+    pthread_rwlock_unlock(&inode_locks[la]);
+    if (la != lb) {
+        pthread_rwlock_unlock(&inode_locks[lb]);
+    }
 }
 
+// The table is a list of chunks that double in size, so the chunk for an
+// inode number comes straight out of its high bit.
 inode *get_inode(int inum) {
+    superblock *sb = pages_get_superblock();
+    // pairs with the release in inode_table_grow(), so the chunk is there
+    assert(inum >= 0 && inum < __atomic_load_n(&sb->inode_count, __ATOMIC_ACQUIRE));
+    int chunk = 31 - __builtin_clz(inum / ITAB_FIRST_CHUNK + 1);
+    int first = ITAB_FIRST_CHUNK * ((1 << chunk) - 1);
+    inode *inodePg = (inode *) pages_get_page(sb->itab[chunk]);
+    return inodePg + (inum - first);
+}
+
+// Add the next chunk to the inode table, doubling its size, and grow the
+// inode bitmap to cover it. Chunks never move, so inode pointers held by
+// callers stay good. Returns 0, or -1 if there's no room.
+static int inode_table_grow() {
+    superblock *sb = pages_get_superblock();
+    if (sb->itab_chunks == ITAB_MAX_CHUNKS) {
+        return -1;
+    }
+
+    int count = ITAB_FIRST_CHUNK << sb->itab_chunks;
+    int chunk = alloc_contiguous(bytes_to_pages(count * sizeof(inode)));
+    if (chunk < 0) {
+        return -1;
+    }
+
+    // the bitmap is only ever reached through the superblock, so it can move
+    int total = sb->inode_count + count;
+    int need = bytes_to_pages((total + 63) / 64 * sizeof(unsigned long));
+    if (need > sb->ibm_pages) {
+        int ibm = alloc_contiguous(need);
+        if (ibm < 0) {
+            free_pages(chunk, bytes_to_pages(count * sizeof(inode)));
+            return -1;
+        }
+        memcpy(pages_get_page(ibm), get_inode_bitmap(), sb->ibm_pages * 4096);
+        free_pages(sb->ibm_start, sb->ibm_pages);
+        sb->ibm_start = ibm;
+        sb->ibm_pages = need;
+    }
+
+    // fresh pages are zeroed, which is what an unused inode looks like
+    sb->itab[sb->itab_chunks++] = chunk;
+    __atomic_store_n(&sb->inode_count, total, __ATOMIC_RELEASE);
+    sb->free_inodes += count;
+    TRACE(TR_INODE, TR_INFO, "+ inode_table_grow() -> %d inodes", total);
+    return 0;
+}
+
+// Take a free inode number, growing the table when it's full.
+// Returns the number, or -1 if the table can't grow any more.
+int alloc_inode() {
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&inode_alloc_lock);
+    if (sb->free_inodes == 0 && inode_table_grow() < 0) {
+        pthread_mutex_unlock(&inode_alloc_lock);
+        return -1;
+    }
+
+    void *ibm = get_inode_bitmap();
+    int inum = bitmap_next_zero(ibm, inode_hint, sb->inode_count);
+    if (inum == -1) {
+        inum = bitmap_next_zero(ibm, 0, inode_hint);
+    }
     assert(inum >= 0);
-    inode *inodePg = (inode *) pages_get_page(1);
-    return inodePg + inum;
+
+    bitmap_put(ibm, inum, 1);
+    sb->free_inodes--;
+    inode_hint = inum + 1;
+    pthread_mutex_unlock(&inode_alloc_lock);
+    return inum;
+}
+
+void free_inode(int inum) {
+    pthread_mutex_lock(&inode_alloc_lock);
+    void *ibm = get_inode_bitmap();
+    assert(bitmap_get(ibm, inum) == 1);
+    bitmap_put(ibm, inum, 0);
+    pages_get_superblock()->free_inodes++;
+    pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+// Inodes the table could ever hold and how many of those are free. The
+// table grows by itself, so everything it hasn't grown into yet is free.
+void inode_counts(long *total, long *free) {
+    superblock *sb = pages_get_superblock();
+    *total = (long) ITAB_FIRST_CHUNK * ((1L << ITAB_MAX_CHUNKS) - 1);
+    pthread_mutex_lock(&inode_alloc_lock);
+    *free = *total - (sb->inode_count - sb->free_inodes);
+    pthread_mutex_unlock(&inode_alloc_lock);
+}
+
+// Regular files and symlinks start out inline, directories never are.
+int inode_can_inline(inode *node) {
+    return S_ISREG(node->mode) || S_ISLNK(node->mode);
+}
+
+// Move an inline file's bytes out to a page so it can keep growing.
+static int inode_uninline(inode *node) {
+    char data[INODE_INLINE];
+    int64_t size = node->size;
+    memcpy(data, node->data, size);
+
+    node->flags &= ~INODE_IS_INLINE;
+    node->depth = 0;
+    node->nexts = 0;
+    node->size = 0;
+    if (size > 0) {
+        if (grow_inode(node, size) < 0) {
+            node->flags |= INODE_IS_INLINE;
+            node->size = size;
+            memcpy(node->data, data, size);
+            return -1;
+        }
+        memcpy(pages_get_page(inode_get_pnum(node, 0)), data, size);
+    }
+    return 0;
+}
+
+// Give every unmapped file page in [fpn, end) a page, in as few
+// physically contiguous runs as possible, each continuing on from the page
+// before it so appends stay sequential on disk. Pages that are already
+// there (fallocate'd ones) are left alone. flags go on the new extents.
+static int fill_holes(inode *node, int fpn, int end, int flags) {
+    while (fpn < end) {
+        int next = extent_next(node, fpn);
+        if (next == fpn) {
+            extent ext;
+            extent_lookup(node, fpn, &ext);
+            fpn = ext.fpn + ext.len;
+            continue;
+        }
+
+        int holeEnd = (next < 0 || next > end) ? end : next;
+        int prev = (fpn > 0) ? extent_lookup(node, fpn - 1, NULL) : 0;
+        int goal = (prev > 0) ? prev + 1 : 0;
+        while (fpn < holeEnd) {
+            int got;
+            int start = alloc_pages(holeEnd - fpn, goal, &got);
+            if (start < 0) {
+                return -1;
+            }
+            if (extent_insert(node, fpn, start, got, flags) < 0) {
+                // nothing points at them yet
+                free_pages(start, got);
+                return -1;
+            }
+            node->pages += got;
+            fpn += got;
+            goal = start + got;
+        }
+    }
+    return 0;
+}
+
+// Make the file size bytes long without giving it any pages: everything
+// past the old end is a hole until it's written. The old tail of the last
+// page is zeroed. Returns 0, or -1 if an inline file couldn't be moved out.
+int extend_inode(inode *node, int64_t size) {
+    int64_t oldSize = node->size;
+    if (size <= oldSize) {
+        return 0;
+    }
+
+    if (node->flags & INODE_IS_INLINE) {
+        if (size <= INODE_INLINE) {
+            memset(node->data + oldSize, 0, size - oldSize);
+            node->size = size;
+            return 0;
+        }
+        if (inode_uninline(node) < 0) {
+            return -1;
+        }
+    }
+
+    if (oldSize % 4096 != 0) {
+        extent ext;
+        int pnum = extent_lookup(node, oldSize / 4096, &ext);
+        if (pnum != 0 && !(ext.flags & EXT_UNWRITTEN)) {
+            memset(pages_get_page(pnum) + oldSize % 4096, 0, 4096 - oldSize % 4096);
+        }
+    }
+    node->size = size;
+    return 0;
+}
+
+// Give the pages under bytes [offset, offset + len) that don't have one a
+// page, with flags on the new extents. Inline files that won't fit any
+// more are moved out first.
+static int map_range(inode *node, int64_t offset, int64_t len, int flags) {
+    int64_t end = offset + len;
+    if (len <= 0) {
+        return 0;
+    }
+    if (node->flags & INODE_IS_INLINE) {
+        if (end <= INODE_INLINE) {
+            return 0;
+        }
+        if (inode_uninline(node) < 0) {
+            return -1;
+        }
+    }
+    return fill_holes(node, offset / 4096, bytes_to_pages(end), flags);
+}
+
+// Make sure bytes [offset, offset + len) have pages to write into. Fresh
+// pages are zeroed. The size doesn't change. Returns 0, or -1 if the space
+// couldn't be found.
+int inode_allocate(inode *node, int64_t offset, int64_t len) {
+    return map_range(node, offset, len, 0);
 }
 
-int alloc_inode();
+// Reserve pages for bytes [offset, offset + len) without writing them:
+// the new extents are EXT_UNWRITTEN, so they read as zeros with nothing
+// having been zeroed. The size doesn't change. Returns 0, or -1 if the
+// space couldn't be found.
+int inode_preallocate(inode *node, int64_t offset, int64_t len) {
+    return map_range(node, offset, len, EXT_UNWRITTEN);
+}
+
+// Grow the file to size bytes with every page allocated, which is what
+// directories want. Returns 0, or -1 if the space couldn't be found.
+int grow_inode(inode *node, int64_t size) {
+    if (size <= node->size) {
+        return 0;
+    }
+    if (inode_allocate(node, node->size, size - node->size) < 0) {
+        return -1;
+    }
+    return extend_inode(node, size);
+}
+
+// Bytes [offset, offset + size) were just written. Unwritten pages in
+// there become part of the file, with whatever the write didn't cover of
+// the first and last ones zeroed. Returns 0, or -1 if the extent tree
+// couldn't be split.
+int inode_mark_written(inode *node, int64_t offset, int64_t size) {
+    if ((node->flags & INODE_IS_INLINE) || size <= 0) {
+        return 0;
+    }
 
-void free_inode();
+    int first = offset / 4096;
+    int end = bytes_to_pages(offset + size);
+    int fpn = first;
+    int rv = 0;
+    while (fpn < end && rv == 0) {
+        extent ext;
+        int pnum = extent_lookup(node, fpn, &ext);
+        assert(pnum != 0);
+        int stop = min(ext.fpn + ext.len, end);
+        if (ext.flags & EXT_UNWRITTEN) {
+            if (fpn == first && offset % 4096 != 0) {
+                memset(pages_get_page(pnum), 0, offset % 4096);
+            }
+            int64_t tail = (offset + size) % 4096;
+            if (stop == end && tail != 0) {
+                memset(pages_get_page(pnum + (stop - 1 - fpn)) + tail, 0, 4096 - tail);
+            }
+            // cursors may be holding the old flags
+            inode_map_gens[inode_lock_for(node)]++;
+            rv = extent_mark_written(node, fpn, stop - fpn);
+        }
+        fpn = stop;
+    }
+    return rv;
+}
+
+// Shrink the file to size bytes, freeing the pages past the new end,
+// fallocate'd ones included. A file that gets small enough goes back to
+// being stored inline.
+void shrink_inode(inode *node, int64_t size) {
+    if (size > node->size) {
+        return;
+    }
+    if (node->flags & INODE_IS_INLINE) {
+        node->size = size;
+        return;
+    }
+    inode_map_gens[inode_lock_for(node)]++;
 
-int grow_inode(inode *node, int size);
+    if (size <= INODE_INLINE && inode_can_inline(node)) {
+        char data[INODE_INLINE];
+        extent ext;
+        int pnum = extent_lookup(node, 0, &ext);
+        if (pnum != 0 && !(ext.flags & EXT_UNWRITTEN)) {
+            memcpy(data, pages_get_page(pnum), size);
+        } else {
+            memset(data, 0, size);
+        }
+        node->pages -= extent_truncate(node, 0);
+        node->flags |= INODE_IS_INLINE;
+        memcpy(node->data, data, size);
+        node->size = size;
+        return;
+    }
 
-int shrink_inode(inode *node, int size);
+    node->pages -= extent_truncate(node, bytes_to_pages(size));
+    node->size = size;
+}
 
-int inode_get_pnum(inode *node, int fpn);
+// Physical page backing file page fpn, or 0 if there isn't one. This is
+// the one place file offsets get turned into pages, and it goes straight
+// to the right extent rather than walking the file from the start.
+int inode_get_pnum(inode *node, int fpn) {
+    if (node->flags & INODE_IS_INLINE) {
+        return 0;
+    }
+    return extent_lookup(node, fpn, NULL);
+}
+
+// Like inode_get_pnum(), but tries the extent in cur first and leaves the
+// one it found there. cur may be NULL.
+int inode_get_pnum_cursor(inode *node, int fpn, inode_cursor *cur) {
+    if (cur == NULL) {
+        return inode_get_pnum(node, fpn);
+    }
+    if (node->flags & INODE_IS_INLINE) {
+        return 0;
+    }
+
+    unsigned gen = inode_map_gens[inode_lock_for(node)];
+    extent *ext = &cur->ext;
+    if (cur->gen == gen && fpn >= ext->fpn && fpn < ext->fpn + ext->len) {
+        return ext->pnum + (fpn - ext->fpn);
+    }
+
+    int pnum = extent_lookup(node, fpn, ext);
+    cur->gen = gen;
+    if (pnum == 0) {
+        ext->len = 0;
+    }
+    return pnum;
+}
+
+// Like inode_get_pnum_cursor(), but also stores in *len how many pages
+// from fpn on follow pnum straight on in the image, so a caller can copy
+// them in one go, and their extent's flags in *flags. For a hole it's how
+// many pages until the next mapped one, however far that is. cur may be
+// NULL.
+int inode_get_run(inode *node, int fpn, int *len, int *flags, inode_cursor *cur) {
+    inode_cursor mine = {0};
+    if (cur == NULL) {
+        cur = &mine;
+    }
+    int pnum = inode_get_pnum_cursor(node, fpn, cur);
+    if (pnum != 0) {
+        *len = cur->ext.fpn + cur->ext.len - fpn;
+        *flags = cur->ext.flags;
+        return pnum;
+    }
+
+    int next = (node->flags & INODE_IS_INLINE) ? fpn + 1 : extent_next(node, fpn);
+    *len = (next < 0) ? INT_MAX - fpn : next - fpn;
+    *flags = 0;
+    return 0;
+}
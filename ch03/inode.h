@@ -4,22 +4,101 @@
 #define INODE_H
 
 #include "pages.h"
+#include <stdint.h>
 #include <time.h>
 
+#define INODE_EXTENTS 4
+
+// extent.flags
+#define EXT_UNWRITTEN 1 // allocated by fallocate, reads as zeros until written
+
+// file pages [fpn, fpn + len) live in physical pages [pnum, pnum + len)
+typedef struct extent {
+    int fpn;
+    int pnum;
+    int len;
+    int flags;
+} extent;
+
+#define INODE_INLINE 80
+
+// inode.flags
+#define INODE_IS_INLINE 1 // data[] holds the file, there are no pages
 
 typedef struct inode {
     int refs; // reference count
     int mode; // permission & type
-    int size; // bytes
-    int ptrs[2]; // direct pointers
-    int iptr; // single indirect pointer
-    time_t /*struct timespec*/ creation_time;
-    time_t /*struct timespec*/ last_change;
-    time_t /*struct timespec*/ last_view;
+    int64_t size; // bytes
+    int flags;
+    int pages; // data pages mapped, fallocate'd ones too, for st_blocks
+    // nanoseconds since the epoch, which is a timespec in 8 bytes
+    int64_t creation_time;
+    int64_t last_change; // mtime
+    union {
+        int64_t last_view;   // atime, see ops_touch()
+        int64_t next_orphan; // once refs is 0 and it's on the orphan list, see reclaim.h
+    };
+    union {
+        struct {
+            int depth; // extent tree depth, 0 while ext[] holds the extents
+            int nexts; // records used in ext[]
+            extent ext[INODE_EXTENTS]; // extents, or the extent tree's root
+        };
+        char data[INODE_INLINE]; // contents of small files
+    };
 } inode;
 
-void print_inode(inode *node);
+_Static_assert(sizeof(inode) == 128, "inodes are 128 bytes on disk");
 
 inode *get_inode(int inum);
 
+int alloc_inode();
+
+void free_inode(int inum);
+
+void inode_counts(long *total, long *free);
+
+int inode_get_pnum(inode *node, int fpn);
+
+// The last extent a lookup landed in, so reading or writing a file in
+// order doesn't go back down the extent tree for every page. Zeroed means
+// empty. Only good under the inode's lock, and only for that inode.
+typedef struct inode_cursor {
+    extent ext;
+    unsigned gen;
+} inode_cursor;
+
+int inode_get_pnum_cursor(inode *node, int fpn, inode_cursor *cur);
+
+int inode_get_run(inode *node, int fpn, int *len, int *flags, inode_cursor *cur);
+
+int grow_inode(inode *node, int64_t size);
+
+int extend_inode(inode *node, int64_t size);
+
+void shrink_inode(inode *node, int64_t size);
+
+int inode_allocate(inode *node, int64_t offset, int64_t len);
+
+int inode_preallocate(inode *node, int64_t offset, int64_t len);
+
+int inode_mark_written(inode *node, int64_t offset, int64_t size);
+
+int inode_can_inline(inode *node);
+
+// A file's data, size and extents, or a directory's entries, are read
+// under inode_rdlock() and changed under inode_wrlock(). Never walk a path
+// while holding one: the walker takes them too.
+void inode_rdlock(inode *node);
+
+void inode_wrlock(inode *node);
+
+int inode_trywrlock(inode *node);
+
+void inode_unlock(inode *node);
+
+void inode_wrlock2(inode *aa, inode *bb);
+
+void inode_unlock2(inode *aa, inode *bb);
+
 #endif
@@ -1,11 +1,15 @@
 // based on cs3650 starter code
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <bsd/string.h>
 #include <assert.h>
 
@@ -19,43 +23,109 @@
 #include "inode.h"
 #include "bitmap.h"
 #include "directory.h"
+#include "dcache.h"
+#include "ops.h"
+#include "handle.h"
+#include "trace.h"
+#include "stats.h"
+#include "reclaim.h"
+#include "nufs_ll.h"
 
 
-static const size_t PAGE_SIZE = 4096;
-static const int NUM_INODES = (2 * 4096) / sizeof(inode);
-
-// Get the inode* at path, else NULL
-// Starts from /
-inode *pathToINode(const char *path) {
-    inode *dirnode = pathToLastItemContainer(path);// get the last directory
+// Get the inode number at path, else -errno
+// Starts from /, unless the dentry cache already knows the answer
+int pathToINum(const char *path) {
+    int inum;
+    unsigned gen;
+    if (dcache_lookup(path, &inum, &gen)) {
+        return (inum == -1) ? -ENOENT : inum;
+    }
 
-    if (strcmp(path, "/") == 0) {
-        return dirnode;
+    inum = directory_walk(path, NULL, NULL);
+    if (inum >= 0 || inum == -ENOENT) {
+        dcache_fill(path, (inum < 0) ? -1 : inum, gen);
     }
-    char *filename = getTextAfterLastSlash(path);
-    //int dirIdx = directory_lookup(dirnode, filename);
-    int inum = directory_lookup_inode(dirnode, filename);
-    //printf("pathToINode ------ looking for %s\n", filename);
-    if (inum == -1) {
+    if (inum < 0) {
         //not found in directory
-        puts("not found in dir");
-        return NULL;
+        TRACE(TR_DIR, TR_DEBUG, "not found in dir");
+    }
+    return inum;
+}
+
+// The inode an open file refers to, from its handle if it has one,
+// otherwise from path.
+static int fileToINum(const char *path, struct fuse_file_info *fi, handle **hh) {
+    *hh = (fi != NULL) ? handle_get(fi->fh) : NULL;
+    if (*hh != NULL) {
+        return (*hh)->inum;
+    }
+    return pathToINum(path);
+}
+
+// /.nufs/stats isn't in the image, it's made up from the counters every
+// time it's read. 1 for the file, 2 for the directory it's in, else 0.
+static int statsPath(const char *path) {
+    if (streq(path, STATS_PATH)) {
+        return 1;
+    }
+    if (streq(path, STATS_DIR)) {
+        return 2;
+    }
+    return 0;
+}
+
+// The stats as text, in a buffer the calling thread keeps until next time
+static const char *statsText(size_t *len) {
+    static __thread char *text;
+    static __thread size_t cap = 0;
+    size_t nn = stats_render(text, cap);
+    if (nn >= cap) {
+        cap = nn + 4096;
+        text = realloc(text, cap);
+        nn = min(stats_render(text, cap), cap - 1);
+    }
+    *len = nn;
+    return text;
+}
+
+static void statsStat(int which, struct stat *st) {
+    memset(st, 0, sizeof(struct stat));
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_nlink = 1;
+    if (which == 2) {
+        st->st_mode = 040555;
+    } else {
+        size_t len;
+        statsText(&len);
+        st->st_mode = 0100444;
+        st->st_size = len;
     }
-    return get_inode(inum);
+}
+
+// Copies what's at offset in the stats into buf, like a read.
+static int statsRead(char *buf, size_t size, off_t offset) {
+    size_t len;
+    const char *text = statsText(&len);
+    if (offset >= len) {
+        return 0;
+    }
+    size = min(size, len - offset);
+    memcpy(buf, text + offset, size);
+    return size;
 }
 
 // implementation for: man 2 access
 // ONLY Checks if a file exists.
 int
 nufs_access(const char *path, int mask) {
-    int rv = 0;
-    inode *fptr = pathToINode(path);
-    if (fptr != NULL) {
+    uint64_t t0 = stats_now();
+    int rv = statsPath(path) ? 0 : pathToINum(path);
+    if (rv >= 0) {
         rv = 0;
-    } else {
-        rv = -ENOENT;
     }
-    printf("access(%s, %04o) -> %d\n", path, mask, rv);
+    TRACE(TR_OPS, TR_INFO, "access(%s, %04o) -> %d", path, mask, rv);
+    stats_op(OP_ACCESS, t0, rv);
     return rv;
 }
 
@@ -63,26 +133,17 @@ nufs_access(const char *path, int mask) {
 // gets an object's attributes (type, permissions, size, etc)
 int
 nufs_getattr(const char *path, struct stat *st) {
+    uint64_t t0 = stats_now();
     int rv = 0;
-    inode *fptr = pathToINode(path);
-
-    if (fptr != NULL) {
-        st->st_dev = 1; //arbitrary
-        st->st_mode = fptr->mode;
-        st->st_nlink = 1; //not doing this yet
-        st->st_uid = getuid();
-        st->st_gid = getgid(); //group id
-        st->st_rdev = 0;
-        st->st_size = fptr->size;
-        st->st_blksize = 4096;
-        st->st_blocks = bytes_to_pages(fptr->size);
-        st->st_ctime = fptr->creation_time;
-        st->st_atime = fptr->last_view;
-        st->st_mtime = fptr->last_change;
-    } else {
-        rv = -ENOENT;
+    int which = statsPath(path);
+    if (which) {
+        statsStat(which, st);
+    } else if ((rv = pathToINum(path)) >= 0) {
+        ops_stat(rv, st);
+        rv = 0;
     }
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
+    TRACE(TR_OPS, TR_INFO, "getattr(%s) -> (%d) {mode: %04o, size: %ld}", path, rv, st->st_mode, st->st_size);
+    stats_op(OP_GETATTR, t0, rv);
     return rv;
 }
 
@@ -91,24 +152,33 @@ nufs_getattr(const char *path, struct stat *st) {
 int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi) {
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t t0 = stats_now();
+    if (statsPath(path) == 2) {
+        struct stat st;
+        statsStat(2, &st);
+        filler(buf, ".", &st, 0);
+        statsStat(1, &st);
+        filler(buf, "stats", &st, 0);
+        stats_op(OP_READDIR, t0, 0);
+        return 0;
+    }
 
-    inode *node = pathToINode(path);
-    if (node == 0 || rv2 < 0) {
-        printf("readdir(%s) -> %d with clock result %i and node result %p\n", path, -1, rv2, node);
-        return -1;
+    int inum = pathToINum(path);
+    if (inum < 0) {
+        TRACE(TR_OPS, TR_INFO, "readdir(%s) -> %d", path, inum);
+        stats_op(OP_READDIR, t0, inum);
+        return inum;
     }
-    node->last_view = ts.tv_sec;
+    ops_touch(inum);
 
     struct stat st;
-    int rv;
-    rv = nufs_getattr(path, &st);
-    assert(rv == 0);
-
+    ops_stat(inum, &st);
     filler(buf, ".", &st, 0);
 
-    slist *contents = directory_list(path);
+    inode *node = get_inode(inum);
+    inode_rdlock(node);
+    slist *contents = directory_list(node);
+    inode_unlock(node);
     slist *cur = contents;
     while (cur != NULL) {
         filler(buf, cur->data, &st, 0);
@@ -116,75 +186,49 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         // https://www.cs.nmsu.edu/~pfeiffer/fuse-tutorial/html/unclear.html
         cur = cur->next;
     }
+    s_free(contents);
 
-    printf("readdir(%s) -> %d\n", path, rv);
-    return rv;
+    TRACE(TR_OPS, TR_INFO, "readdir(%s) -> %d", path, 0);
+    stats_op(OP_READDIR, t0, 0);
+    return 0;
 }
 
-// mknod makes a filesystem object like a file or directory
-// called for: man 2 open, man 2 link
-int
-nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    puts("MKNOD has been summoned");
-
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-
-    if (rv2 < 0) {
-        puts("Time error in MKNOD");
-        return -1;
+// Find the directory path's last component goes in. Returns 0, or -EEXIST
+// if it's already there, or why the directory couldn't be found.
+static int pathToParent(const char *path, int *parent, const char **name) {
+    int rv = directory_walk(path, parent, name);
+    if (rv >= 0) {
+        return -EEXIST;
     }
-
-
-    int rv = -1;
-    inode *inodes = (inode *) pages_get_page(1);
-    if (inodes == NULL) {
-        puts("Unable to get first page");
-        return -1;
+    if (*parent < 0) {
+        return rv;
     }
+    return 0;
+}
 
-    inodes->last_change = ts.tv_sec;
-    //printf("current time is %li %li \n", ts.tv_sec, ts.tv_sec);
-
-    void *inodeBitmap = get_inode_bitmap();
-
-
-    int i = 0;
-    int bit = bitmap_get(inodeBitmap, i);
-    while (i < NUM_INODES) {
-        if (bit == 0) {
-
-            //found free spot, set empty inode info
-            inodes[i].refs = 1;
-            inodes[i].mode = mode;
-            inodes[i].size = 0;
-            inodes[i].ptrs[0] = 0;
-            inodes[i].ptrs[1] = 0;
-            inodes[i].iptr = 0;
-            inodes[i].creation_time = ts.tv_sec;
-            inodes[i].last_change = ts.tv_sec;
-            inodes[i].last_view = ts.tv_sec;
-
-            rv = 0;
-            bitmap_put(inodeBitmap, i, 1);
-
-            //Set directory entry to point to the above inode
-            inode *dirPtr = pathToLastItemContainer(path);
-            char *fileName = getTextAfterLastSlash(path);
-            int a = directory_put(dirPtr, fileName, i);
-            //printf("put %s at dirent %d\n", fileName, a);
-            break;
-        }
-        i++;
-        bit = bitmap_get(inodeBitmap, i);
+// Makes a filesystem object like a file or directory
+static int makeNode(const char *path, mode_t mode) {
+    if (statsPath(path)) {
+        return -EEXIST;
     }
-    if (i == NUM_INODES) {
-        puts("MKNOD FAILED");
-        printf("mknod(%s, %04o) -> %d\n", path, mode, -1);
-        return -1;
+    int parentNum;
+    const char *fileName;
+    int inum;
+    int rv = pathToParent(path, &parentNum, &fileName);
+    if (rv == 0) {
+        rv = ops_create(parentNum, fileName, path, mode, &inum);
     }
-    printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
-    fflush(stdout);
+    return rv;
+}
+
+// mknod makes a filesystem object like a file or directory
+// called for: man 2 open, man 2 link
+int
+nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
+    uint64_t t0 = stats_now();
+    int rv = makeNode(path, mode);
+    TRACE(TR_OPS, TR_INFO, "mknod(%s, %04o) -> %d", path, mode, rv);
+    stats_op(OP_MKNOD, t0, rv);
     return rv;
 }
 
@@ -192,54 +236,34 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
 // another system call; see section 2 of the manual
 int
 nufs_mkdir(const char *path, mode_t mode) {
-    int rv = nufs_mknod(path, mode | 040000, 0);
-    inode *ptr = pathToINode(path);
-    if (ptr == 0) {
-        perror("Mkdir path lookup failed");
-        return -1;
-    }
-    ptr->ptrs[0] = alloc_page();
-    ptr->size = 4096;
-    void *dataPg = pages_get_page(ptr->ptrs[0]);
-    if (dataPg != NULL) {
-        dirent *cur = (dirent *) dataPg;
-        for (int i = 0; i < (PAGE_SIZE / sizeof(dirent)); ++i) {
-            cur[i].inum = -1;
-        }
-    }
-    printf("mkdir(%s) -> %d\n", path, rv);
+    uint64_t t0 = stats_now();
+    // makeNode sets up the directory's index
+    int rv = makeNode(path, mode | 040000);
+    TRACE(TR_OPS, TR_INFO, "mkdir(%s) -> %d", path, rv);
+    stats_op(OP_MKDIR, t0, rv);
     return rv;
 }
 
 
 int
 nufs_link(const char *from, const char *to) {
-    int rv = -1;
-
-    inode *dd = pathToLastItemContainer(from);
-
-    int iNodeNumber = directory_lookup_inode(dd, getTextAfterLastSlash(from));
-
-    inode *file = pathToINode(from);
-    if (file == 0) {
-        perror("Unable to find matching file in link");
-        return -1;
+    uint64_t t0 = stats_now();
+    int iNodeNumber = pathToINum(from);
+    if (iNodeNumber < 0) {
+        TRACE(TR_OPS, TR_INFO, "link(%s => %s) -> %d", from, to, iNodeNumber);
+        stats_op(OP_LINK, t0, iNodeNumber);
+        return iNodeNumber;
     }
 
-    inode *toDir = pathToLastItemContainer(to);
-
-
-    int dirOut = directory_put(toDir, getTextAfterLastSlash(to), iNodeNumber);
-
-    if (dirOut < 0) {
-        return -1;
+    int toParent;
+    const char *toName;
+    int rv = pathToParent(to, &toParent, &toName);
+    if (rv == 0) {
+        rv = ops_link(iNodeNumber, toParent, toName, to);
     }
 
-
-    file->refs++;
-    rv = 0;
-
-    printf("link(%s => %s) -> %d\n", from, to, rv);
+    TRACE(TR_OPS, TR_INFO, "link(%s => %s) -> %d", from, to, rv);
+    stats_op(OP_LINK, t0, rv);
     return rv;
 }
 
@@ -247,773 +271,192 @@ nufs_link(const char *from, const char *to) {
 // called to move a file within the same filesystem
 int
 nufs_rename(const char *from, const char *to) {
-    int rv = -1;
-//    void *inodes = pages_get_page(1);
-//    inode *dirInode = (inode *) inodes;
-
-    inode *dirInodeFrom = pathToLastItemContainer(from);
-    inode *dirInodeTo = pathToLastItemContainer(to);
-
-    char *fileNameFrom = getTextAfterLastSlash(from);
-    char *fileNameTo = getTextAfterLastSlash(to);
-
-    int fromINode = directory_lookup_inode(dirInodeFrom, fileNameFrom);
-    int toINode = directory_lookup_inode(dirInodeTo, fileNameTo);
-
+    uint64_t t0 = stats_now();
+    int fromParent;
+    int toParent;
+    const char *fileNameFrom;
+    const char *fileNameTo;
 
-    //-- Check errors --
-
-    // Both directory paths exist?
-    if (dirInodeFrom == NULL || dirInodeTo == NULL) {
-        return -1;
-    }
-    // from directory has the file, to directory does not
-    if (!(fromINode >= 0 && toINode < 0)) {
-        return -1;
+    int rv = directory_walk(from, &fromParent, &fileNameFrom);
+    if (rv >= 0) {
+        rv = pathToParent(to, &toParent, &fileNameTo);
     }
-
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    if (rv2 < 0) {
-        return -1;
+    if (rv >= 0) {
+        rv = ops_rename(fromParent, fileNameFrom, from, toParent, fileNameTo, to);
     }
-    dirInodeFrom->last_view = ts.tv_sec;
-    dirInodeFrom->last_change = ts.tv_sec;
 
-    dirInodeTo->last_view = ts.tv_sec;
-    dirInodeTo->last_change = ts.tv_sec;
-
-    rv = directory_delete(dirInodeFrom, fileNameFrom);
-    if (rv < 0) {
-        puts("Rename - directory_delete failed");
-        return -1;
-    }
-    rv = directory_put(dirInodeTo, fileNameTo, fromINode);
-    if (rv < 0) {
-        puts("Rename - directory_put failed");
-        return -1;
-    }
-
-    /* old stuff
-    int idx = directory_lookup(dirInode, fileName);//(from + 1));
-    if (idx != -1) {
-        //found the from entry
-        dirent *entry = dirEntries + idx;
-        strcpy(entry->name, (to + 1));
-        rv = 0;
-    }*/
-    rv = 0;
-    printf("rename(%s => %s) -> %d\n", from, to, rv);
+    TRACE(TR_OPS, TR_INFO, "rename(%s => %s) -> %d", from, to, rv);
+    stats_op(OP_RENAME, t0, rv);
     return rv;
 }
 
 int
 nufs_chmod(const char *path, mode_t mode) {
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    if (rv2 < 0) {
-        return -1;
+    uint64_t t0 = stats_now();
+    int rv = pathToINum(path);
+    if (rv >= 0) {
+        rv = ops_chmod(rv, mode);
     }
-
-    inode *node = pathToINode(path);
-    node->mode = mode;
-    node->last_change = ts.tv_sec;
-    int rv = 0;
-    printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    TRACE(TR_OPS, TR_INFO, "chmod(%s, %04o) -> %d", path, mode, rv);
+    stats_op(OP_CHMOD, t0, rv);
     return rv;
 }
 
 int
-nufs_truncate_expand(const char *path, off_t size) {
-    puts("CALL TO TRUNCATE EXPAND");
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    if (rv2 < 0) {
-        puts("time error");
-        return -1;
-    }
-    inode *fptr = pathToINode(path);
-    if (fptr == 0) {
-        perror("path not found");
-        return -1;
-    }
-
-    fptr->last_change = ts.tv_sec;
-
-    int currPage = bytes_to_pages(fptr->size);
-    int goalPages = bytes_to_pages(size);
-    int pagesToAdd = goalPages - currPage;
-    int sizeToAdd = size - fptr->size;
-
-    printf("currNodeSize: %zu and size %li\n", fptr->size, size);
-    printf("currPage %i, goalPages %i, pagesToAdd %i, sizeToAdd %i\n", currPage, goalPages, pagesToAdd,
-           sizeToAdd);
-
-    while (pagesToAdd > 0) {
-        printf("loop on line 366 with pagesTo Add: %i and size to Add:%i\n", pagesToAdd, sizeToAdd);
-
-        if (currPage == 0) {
-            fptr->ptrs[0] = alloc_page();
-            sizeToAdd = max(sizeToAdd - PAGE_SIZE, 0);
-        }
-
-        //UPDATE THE SIZE
-        if (currPage == 1) {
-            puts("currPAge 1");
-
-            if (fptr->ptrs[0] == 0) {
-                fptr->ptrs[0] = alloc_page();
-            }
-
-
-            void *pg = pages_get_page(fptr->ptrs[0]);
-
-            long currSizeToAdd = min(sizeToAdd, PAGE_SIZE - fptr->size);
-
-            memset(pg + fptr->size, 0, currSizeToAdd);//sizeLeft);
-
-            fptr->size += currSizeToAdd;
-            sizeToAdd -= currSizeToAdd;
-
-        } else if (currPage == 2) {//numPages == 2) {
-            puts("currPAge 2");
-
-            if (fptr->ptrs[1] == 0) {
-                fptr->ptrs[1] = alloc_page();
-            }
-
-            void *pg = pages_get_page(fptr->ptrs[1]);
-
-            long currSizeToAdd = min(sizeToAdd, (2 * PAGE_SIZE) - fptr->size);
-
-
-            memset(pg + (fptr->size - PAGE_SIZE), 0, currSizeToAdd);//sizeLeft);
-            //                     ^^^^ how far into 2nd pg we are
-
-            fptr->size += currSizeToAdd;
-            sizeToAdd -= currSizeToAdd;
-
-        } else {
-            puts("currPAge Else");
-
-            if (fptr->iptr == 0) {
-                fptr->iptr = alloc_page();
-            }
-
-            int indirectPoints = fptr->iptr;
-            int *indirectPage = pages_get_page(indirectPoints);
-
-            if (indirectPage == 0) {
-                perror("Page lookup failed");
-                return -1;
-            }
-
-            int *curr_index_pointer = indirectPage;
-            int index = 0;
-            while (*curr_index_pointer != 0) {
-                printf("loop of while (%i != 0) wiht index %i\n", *curr_index_pointer, index);
-                curr_index_pointer = curr_index_pointer + 1;
-                index++;
-
-                if (index == PAGE_SIZE / sizeof(int)) {
-                    puts("PAGE OVERFLOW");
-                    return -1;
-                }
-            }
-            index--;
-
-            //index is last allocated index on indirect page
-
-            if (index == -1) {
-                indirectPage[0] = alloc_page();
-                index = 0;
-
-            }
-
-
-            int *currPointer = indirectPage + index;
-            int currPAge = *(currPointer);
-            void *pg = pages_get_page(currPAge);
-
-            long currSizeToAdd = min(sizeToAdd, (PAGE_SIZE * (index + 3)) - fptr->size);
-
-
-            memset(pg + (fptr->size % PAGE_SIZE), 0, currSizeToAdd);//sizeLeft);
-
-            if (sizeToAdd + (fptr->size % PAGE_SIZE) > PAGE_SIZE) {
-                printf("if (%li == PAGE_SIZE)", currSizeToAdd);
-                indirectPage[index + 1] = alloc_page();
-            }
-
-            fptr->size += currSizeToAdd;
-            sizeToAdd -= currSizeToAdd;
-        }
-
-        currPage++;
-        pagesToAdd--;
+nufs_truncate(const char *path, off_t size) {
+    uint64_t t0 = stats_now();
+    int rv = pathToINum(path);
+    if (rv >= 0) {
+        rv = ops_truncate(rv, size);
     }
-
-    fptr->size = size;
-    int rv = 0;
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    TRACE(TR_OPS, TR_INFO, "truncate(%s, %ld bytes) -> %d", path, size, rv);
+    stats_op(OP_TRUNCATE, t0, rv);
     return rv;
-
 }
 
-int
-nufs_truncate_remove(const char *path, off_t size) {
-    puts("CALL TO TRUNCATE");
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    if (rv2 < 0) {
-        puts("time error");
-        return -1;
-    }
-    inode *fptr = pathToINode(path);
-    if (fptr == 0) {
-        perror("path not found");
-        return -1;
+// Drop a name found with ulink(), freeing the inode if it was the last one
+static int
+nufs_remove(const char *path, int (*ulink)(int, const char *, const char *, int *)) {
+    int parentNum;
+    const char *fileName;
+    int inodeNum = directory_walk(path, &parentNum, &fileName);
+    if (inodeNum < 0) {
+        return inodeNum;
     }
 
-    fptr->last_change = ts.tv_sec;
-
-    size_t currNodeSize = fptr->size;
-    int currPage = bytes_to_pages(currNodeSize);
-    int goalPages = bytes_to_pages(size);
-    int pagesToRemove = currPage - goalPages;
-    int sizeToRemove = currNodeSize - size;
-
-    printf("currNodeSize: %zu and size %li\n", currNodeSize, size);
-    printf("currPage %i, goalPages %i, pagesToRemove %i, sizeToRemove  %i\n", currPage, goalPages, pagesToRemove,
-           sizeToRemove);
-
-    while (pagesToRemove > 0) {
-        printf("loop on line 366 with pagesToRemove: %i and size to remove:%i\n", pagesToRemove, sizeToRemove);
-
-        //UPDATE THE SIZE
-        if (currPage == 1) {
-            puts("currPAge 1");
-            void *pg = pages_get_page(fptr->ptrs[0]);
-
-            long currSizeToRemove = min(sizeToRemove, PAGE_SIZE);
-
-            memset(pg + PAGE_SIZE - currSizeToRemove, 0, currSizeToRemove);//sizeLeft);
-
-            if (currSizeToRemove == PAGE_SIZE) {
-                free_page(fptr->ptrs[0]);
-                fptr->ptrs[0] = 0;
-            }
-
-            fptr->size -= currSizeToRemove;
-            sizeToRemove -= currSizeToRemove;
-
-        } else if (currPage == 2) {//numPages == 2) {
-            puts("currPAge 2");
-            void *pg = pages_get_page(fptr->ptrs[1]);
-
-            long currSizeToRemove = min(sizeToRemove, PAGE_SIZE);
-
-
-            memset(pg + PAGE_SIZE - currSizeToRemove, 0, currSizeToRemove);//sizeLeft);
-
-            if (currSizeToRemove == PAGE_SIZE) {
-                free_page(fptr->ptrs[1]);
-                fptr->ptrs[1] = 0;
-            }
-
-            fptr->size -= currSizeToRemove;
-            sizeToRemove -= currSizeToRemove;
-
-            if (fptr->iptr != 0) {
-                free_page(fptr->iptr);
-                fptr->iptr = 0;
-            }
-
-        } else {
-            puts("currPAge Else");
-            int indirectPoints = fptr->iptr;
-            int *indirectPage = pages_get_page(indirectPoints);
-
-            if (indirectPage == 0) {
-                perror("Page lookup failed");
-                return -1;
-            }
-
-            int *curr_index_pointer = indirectPage;
-            int index = 0;
-            while (*curr_index_pointer != 0) {
-                printf("loop of while (%i != 0) wiht index %i\n", *curr_index_pointer, index);
-                curr_index_pointer = curr_index_pointer + 1;
-                index++;
-
-                if (index == PAGE_SIZE / sizeof(int)) {
-                    puts("PAGE OVERFLOW");
-                    return -1;
-                }
-            }
-            index--;
-
-            //index is last allocated indx on indirect page
-            if (index == -1) {
-                int indirect = fptr->iptr;
-                pages_free(indirect);
-                fptr->iptr = 0;
-
-                currPage--;
-                pagesToRemove--;
-                continue;
-            }
-
-
-            int *currPointer = indirectPage + index;
-            int currPAge = *(currPointer);
-            void *pg = pages_get_page(currPAge);
-
-            long currSizeToRemove = min(sizeToRemove, PAGE_SIZE);
-
-            memset(pg + PAGE_SIZE - currSizeToRemove, 0, currSizeToRemove);//sizeLeft);
-
-            if (currSizeToRemove == PAGE_SIZE) {
-                printf("if (%li == PAGE_SIZE)", currSizeToRemove);
-                free_page(currPAge);
-                memset(currPointer, 0, sizeof(int));//sizeLeft);
-            }
-
-            fptr->size -= currSizeToRemove;
-            sizeToRemove -= currSizeToRemove;
-        }
-
-        currPage--;
-        pagesToRemove--;
-    }
-
-    fptr->size = size;
-    int rv = 0;
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
-    return rv;
-}
-
-
-int
-nufs_truncate(const char *path, off_t size) {
-    inode *node = pathToINode(path);
-    if (node == 0) {
-        return -1;
+    int rv = ulink(parentNum, fileName, path, &inodeNum);
+    if (rv < 0) {
+        return rv;
     }
-
-    if (size > node->size) {
-        nufs_truncate_expand(path, size);
-    } else if (size == node->size) {
-        return 0;
-    } else {
-        nufs_truncate_remove(path, size);
+    if (rv == 1) {
+        // the name is gone now, so free the pages through the inode
+        ops_evict(inodeNum);
     }
+    return 0;
 }
 
 int
 nufs_unlink(const char *path) {
-    int rv = -1;
-
-    inode *dirPtr = pathToLastItemContainer(path);
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    dirPtr->last_change = ts.tv_sec;
-
-    char *fileName = getTextAfterLastSlash(path);
-    int inodeNum = directory_lookup_inode(dirPtr, fileName);
-    //int inodeNum = directory_delete(dirPtr, fileName);
-    assert(inodeNum >= 0);
-
-    inode *fileptr = get_inode(inodeNum);
-    fileptr->last_change = ts.tv_sec;
-
-    fileptr->refs--;
-
-    if (fileptr->refs == 0) {
-        directory_delete(dirPtr, fileName);
-
-        nufs_truncate_remove(path, 0);
-
-        bitmap_put(get_inode_bitmap(), inodeNum, 0);
-    }
-
-    rv = 0;
-    printf("unlink(%s) -> %d\n", path, rv);
+    uint64_t t0 = stats_now();
+    int rv = nufs_remove(path, ops_unlink);
+    TRACE(TR_OPS, TR_INFO, "unlink(%s) -> %d", path, rv);
+    stats_op(OP_UNLINK, t0, rv);
     return rv;
 }
 
-//note this is only called by nufs when directory is empty
 int
 nufs_rmdir(const char *path) {
-    int rv = -1;
-
-    slist *contents = directory_list(path);
-    if (contents != NULL) {
-        return -1;
-    }
-    rv = nufs_unlink(path);
-    printf("rmdir(%s) -> %d\n", path, rv);
+    uint64_t t0 = stats_now();
+    int rv = nufs_remove(path, ops_rmdir);
+    TRACE(TR_OPS, TR_INFO, "rmdir(%s) -> %d", path, rv);
+    stats_op(OP_RMDIR, t0, rv);
     return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// Looks the file up once and keeps the inode in a handle, so reads and
+// writes don't have to find it again.
 int
 nufs_open(const char *path, struct fuse_file_info *fi) {
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-    if (rv2 < 0) {
-        return -1;
+    uint64_t t0 = stats_now();
+    int rv;
+    if (statsPath(path)) {
+        // no handle, and no page cache: it changes without us being told
+        rv = ((fi->flags & O_ACCMODE) == O_RDONLY) ? 0 : -EACCES;
+        fi->fh = 0;
+        fi->direct_io = 1;
+    } else if ((rv = pathToINum(path)) >= 0) {
+        fi->fh = handle_open(rv, fi->flags);
+        rv = 0;
     }
-
-    inode *node = pathToINode(path);
-    node->last_view = ts.tv_sec;
-
-    int rv = 0;
-    printf("open(%s) -> %d\n", path, rv);
+    TRACE(TR_OPS, TR_INFO, "open(%s) -> %d", path, rv);
+    stats_op(OP_OPEN, t0, rv);
     return rv;
 }
 
-
-int read_indirect_page(inode *fptr, char *buf, size_t size, off_t offset) {//sizeLeft) {
-    //printf("---indirect---- size = %ld || off = %ld\n", size, offset);
-    off_t offHere = offset; //- (2 * PAGE_SIZE); //already checked 2 pages by the time we got here
-    void *metaPg = pages_get_page(fptr->iptr);
-    if (metaPg < 0) {
-        return -1;
-    }
-    int *metaPgInt = (int *) metaPg;
-    off_t i = offHere / PAGE_SIZE;
-
-    //printf("offset = %ld ||| offhere = %ld\n", offset, offHere);
-    size_t sizeLeft = size;
-    size_t sizeRead = 0;
-    // Add the data
-    while (sizeLeft > 0) {
-        //printf("sizeleft = %ld\n", sizeLeft);
-        int nextPgIdx = metaPgInt[i];
-        void *curPg = pages_get_page(nextPgIdx);
-        if (offHere < PAGE_SIZE) {
-            offHere = max(0, offHere);
-
-            size_t num_to_Read = min(PAGE_SIZE, max(sizeLeft + offHere, 0));
-            printf("reading in %li page of size %zu\n", i, num_to_Read);
-
-            memcpy(buf, curPg + offHere, num_to_Read);
-
-            sizeRead += num_to_Read;
-            buf += num_to_Read;
-            i++;
-            sizeLeft -= num_to_Read;
-
-            offHere = 0;
-
-        } else {
-            offHere -= PAGE_SIZE;
-        }
-    }
-    return sizeRead;
+// called on every close() of the file; writes already went straight
+// into the image, so there's nothing to push out
+int
+nufs_flush(const char *path, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    TRACE(TR_OPS, TR_INFO, "flush(%s) -> %d", path, 0);
+    stats_op(OP_FLUSH, t0, 0);
+    return 0;
 }
 
-//analogous to writing (ie. in PAGE_SIZE byte chunks)
-int read_pages(inode *fptr, char *buf, size_t size, off_t offset) {
-    printf("Reading in size and offset %zu %li \n", size, offset);
-
-    int numPages = bytes_to_pages(fptr->size + offset);
-    int sizeLeft = size;//fptr->size;
-    int sizeRead = 0;
-
-    size_t mutated_offset = offset;
-
-    if (numPages == 1 && offset < PAGE_SIZE) {
-        puts("read from first page");
-        void *pg = pages_get_page(fptr->ptrs[0]);
-        size_t num_to_Read = min(PAGE_SIZE, max(sizeLeft + mutated_offset, 0));
-        printf("reading in first page of size %zu and returning\n", num_to_Read);
-
-
-        memcpy(buf, pg + mutated_offset, num_to_Read);
-        sizeRead += num_to_Read;
-        return sizeRead;//fptr->size;
-    }
-    if (numPages > 1 && offset < PAGE_SIZE) {
-        void *pg = pages_get_page(fptr->ptrs[0]);
-
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("reading in first page of size %zu\n", num_to_Read);
-
-        memcpy(buf, pg + mutated_offset, num_to_Read);
-
-        sizeRead += num_to_Read;
-        sizeLeft -= num_to_Read;
-        buf += num_to_Read;
-    }
-
-    mutated_offset = max(0, (mutated_offset - PAGE_SIZE));
-
-    if (numPages == 2 && offset < (2 * PAGE_SIZE)) {
-        puts("read from second page");
-        void *pg = pages_get_page(fptr->ptrs[1]);
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("reading in second page of size %zu and returning \n", num_to_Read);
-
-        memcpy(buf, pg + mutated_offset, num_to_Read);
-
-        sizeRead += num_to_Read;
-        return sizeRead;
-    }
-    if (numPages > 2 && offset < (2 * PAGE_SIZE)) {
-        void *pg = pages_get_page(fptr->ptrs[1]);
-
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("reading in second page of size %zu\n", num_to_Read);
-
-        memcpy(buf, pg + mutated_offset, num_to_Read);
-
-        sizeLeft -= num_to_Read;
-        sizeRead += num_to_Read;
-        buf += num_to_Read;
-    }
-
-    mutated_offset = max(0, (mutated_offset - PAGE_SIZE));
-
-    int rv = read_indirect_page(fptr, buf, sizeLeft, max(0, mutated_offset));//size, offset);//sizeLeft);
-
-    if (rv < 0) {
-        perror("read indirect pages failed");
-        return -1;
-    }
-
-    printf("size read %i and rv is %i", sizeRead, rv);
-    return sizeRead + rv;// + PAGE_SIZE + PAGE_SIZE;
+// the last close, the handle goes away
+int
+nufs_release(const char *path, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    handle_close(fi->fh);
+    TRACE(TR_OPS, TR_INFO, "release(%s) -> %d", path, 0);
+    stats_op(OP_RELEASE, t0, 0);
+    return 0;
 }
 
-
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    printf("Call to read of size %zu and offset%li\n", size, offset);
-
-    int rv = -1;
-    inode *fptr = pathToINode(path);
+    uint64_t t0 = stats_now();
+    TRACE(TR_OPS, TR_DEBUG, "Call to read of size %zu and offset%li", size, offset);
 
-    struct timespec ts;
-    int rv2 = clock_gettime(CLOCK_REALTIME, &ts);
-
-    if (rv2 < 0) {
-        printf("readdir(%s) -> %d with clock restult %i and node result\n", path, -1, rv2);
-        return -1;
-    }
-
-    if (fptr != NULL) {
-
-        if (fptr->size < offset) {
-            perror("File offset for read was greater than the file size");
-            return 0;
-        }
-
-        fptr->last_change = ts.tv_sec;
-        rv = read_pages(fptr, buf, size, offset);
+    handle *hh;
+    int rv;
+    if (statsPath(path)) {
+        rv = statsRead(buf, size, offset);
+    } else if ((rv = fileToINum(path, fi, &hh)) >= 0) {
+        rv = ops_read(rv, buf, size, offset, hh);
     }
 
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n\n", path, size, offset, rv);
+    TRACE(TR_OPS, TR_INFO, "read(%s, %ld bytes, @+%ld) -> %d", path, size, offset, rv);
+    stats_op(OP_READ, t0, rv);
     return rv;
 }
 
-//could probably use offset bytes_to_page to figure out where we write
-//instead of checking for == 0
-int write_indirect_page(inode *fptr, const char *buf, size_t size, off_t offset) {//sizeLeft) {
-    off_t offHere = offset; //- (2 * PAGE_SIZE); //already checked 2 pages by the time we got here
-
-    if (fptr->iptr == 0) {
-        fptr->iptr = alloc_page();
-    }
-
-    void *metaPg = pages_get_page(fptr->iptr);
-    if (metaPg < 0) {
-        return -1;
-    }
-    int *metaPgInt = (int *) metaPg;
-    off_t i = offHere / PAGE_SIZE;
-
-    //printf("offset = %ld ||| offhere = %ld\n", offset, offHere);
-    long sizeLeft = size;
-    size_t sizeRead = 0;
-    // Add the data
-    while (sizeLeft > 0) {
-        printf("sizeleft = %ld\n", sizeLeft);
-        if (metaPgInt[i] == 0) {
-
-
-            int nextPgIdx = alloc_page();
-
-            if (nextPgIdx < 0) {
-                return -1;
-            }
-
-            metaPgInt[i] = nextPgIdx;
-        }
-
-        void *curPg = pages_get_page(metaPgInt[i]);
-        if (offHere < PAGE_SIZE) {
-            offHere = max(0, offHere);
-
-            size_t num_to_Write = min(PAGE_SIZE, max(sizeLeft + offHere, 0));
-//            printf("size plus offset is %lu\n", sizeLeft);
-            printf("writing in %li page of size %zu\n", i, num_to_Write);
-
-            memcpy(curPg + offHere, buf, num_to_Write);
-
-            sizeRead += num_to_Write;
-            buf += num_to_Write;
-            i++;
-            sizeLeft -= num_to_Write;
-
-            offHere = 0;
-
-        } else {
-            puts("skipping becasue of offset");
-            offHere -= PAGE_SIZE;
-        }
-    }
-    return sizeRead;
-}
-
-
-//this doesn't really use offset.... is that a problem?
-//see note above, could probably  use to figure out what page to write to immediately
-int write_pages(inode *fptr, const char *buf, size_t size, off_t offset) {
-    printf("TO WRITE %zu with offset %zu\n", size, offset);
-
-    int numPages = bytes_to_pages(size + offset);
-    int sizeLeft = size;//fptr->size;
-    int sizeRead = 0;
-
-    size_t mutated_offset = offset;
-
-    if (numPages == 1 && offset < PAGE_SIZE) {
-        puts("write to first page");
-        if (fptr->ptrs[0] == 0) {
-            fptr->ptrs[0] = alloc_page();
-        }
-        void *pg = pages_get_page(fptr->ptrs[0]);
-        size_t num_to_Read = min(PAGE_SIZE, max(sizeLeft + mutated_offset, 0));
-        printf("write in first page of size %zu and returning\n", num_to_Read);
-
-
-        memcpy(pg + mutated_offset, buf, num_to_Read);
-        sizeRead += num_to_Read;
-        return sizeRead;//fptr->size;
-    }
-    if (numPages > 1 && offset < PAGE_SIZE) {
-        if (fptr->ptrs[0] == 0) {
-            fptr->ptrs[0] = alloc_page();
-        }
-        void *pg = pages_get_page(fptr->ptrs[0]);
-
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("write in first page of size %zu\n", num_to_Read);
-
-        memcpy(pg + mutated_offset, buf, num_to_Read);
-
-        sizeRead += num_to_Read;
-        sizeLeft -= num_to_Read;
-        buf += num_to_Read;
-    }
-
-    mutated_offset = max(0, (mutated_offset - PAGE_SIZE));
-
-
-    if (numPages == 2 && offset < (2 * PAGE_SIZE)) {
-        puts("write from second page");
-        if (fptr->ptrs[1] == 0) {
-            fptr->ptrs[1] = alloc_page();
-        }
-        void *pg = pages_get_page(fptr->ptrs[1]);
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("write in second page of size %zu and returning \n", num_to_Read);
-
-        memcpy(pg + mutated_offset, buf, num_to_Read);
-
-        sizeRead += num_to_Read;
-        return sizeRead;
-    }
-    if (numPages > 2 && offset < (2 * PAGE_SIZE)) {
-        if (fptr->ptrs[1] == 0) {
-            fptr->ptrs[1] = alloc_page();
-        }
-        void *pg = pages_get_page(fptr->ptrs[1]);
-
-        size_t num_to_Read = max(0, min(sizeLeft + mutated_offset, PAGE_SIZE));
-        printf("write in second page of size %zu\n", num_to_Read);
-
-        memcpy(pg + mutated_offset, buf, num_to_Read);
-
-        sizeLeft -= num_to_Read;
-        sizeRead += num_to_Read;
-        buf += num_to_Read;
-    }
-
-    mutated_offset = max(0, (mutated_offset - PAGE_SIZE));
-
-
-    int rv = write_indirect_page(fptr, buf, sizeLeft, max(0, mutated_offset));//size, offset);//sizeLeft);
-    if (rv < 0) {
-        perror("write indirect pages failed");
-        return -1;
-    }
-
-    return sizeRead + rv;// + PAGE_SIZE + PAGE_SIZE;
-}
-
 // Actually write data
 // This function is called with size being how much to write at a time
 // ie. for a 5K file, it's called twice with appropriate sizes and offsets
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    int rv = -1;
-    inode *fptr = pathToINode(path);
-    if (fptr != NULL) {
-        //currently assume just writing 1 page or less
-        //mode is set in mknod
-
-
-        struct timespec ts;
-        rv = clock_gettime(CLOCK_REALTIME, &ts);
-        if (rv < 0) {
-            puts("nufs write time stamp error");
-            return -1;
-        }
-
-        rv = write_pages(fptr, buf, size, offset);
-
-        if (offset + size >= fptr->size) {
-            fptr->size = offset + size;
-        }
-        fptr->last_change = ts.tv_sec;
-
-        //assert the copy didn't fail?
-        //rv = size;
+    uint64_t t0 = stats_now();
+    handle *hh;
+    int rv = fileToINum(path, fi, &hh);
+    if (rv >= 0) {
+        rv = ops_write(rv, buf, size, offset, hh);
     }
 
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    TRACE(TR_OPS, TR_INFO, "write(%s, %ld bytes, @+%ld) -> %d", path, size, offset, rv);
+    stats_op(OP_WRITE, t0, rv);
     return rv;
 }
 
-int changeTimeStamp(const char *path, const struct timespec ts[2]) {
-    inode *thing = pathToINode(path);
-    thing->last_view = ts[0].tv_sec;
-    thing->last_change = ts[1].tv_sec;
-    return 0;
+// Write data straight from FUSE's buffer, or the pipe it spliced the
+// request into, to the file's pages
+int
+nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+               struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    handle *hh;
+    int rv = fileToINum(path, fi, &hh);
+    if (rv >= 0) {
+        rv = ops_write_buf(rv, buf, offset, hh);
+    }
+
+    TRACE(TR_OPS, TR_INFO, "write_buf(%s, %ld bytes, @+%ld) -> %d", path, fuse_buf_size(buf), offset, rv);
+    stats_op(OP_WRITE, t0, rv);
+    return rv;
 }
 
 // Update the timestamps on a file or directory.
 int
 nufs_utimens(const char *path, const struct timespec ts[2]) {
-    int rv = changeTimeStamp(path, ts);
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
+    uint64_t t0 = stats_now();
+    int rv = pathToINum(path);
+    if (rv >= 0) {
+        rv = ops_utimens(rv, ts);
+    }
+    TRACE(TR_OPS, TR_INFO, "utimens(%s, [%ld, %ld; %ld %ld]) -> %d",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+    stats_op(OP_UTIMENS, t0, rv);
     return rv;
 }
 
@@ -1021,55 +464,111 @@ nufs_utimens(const char *path, const struct timespec ts[2]) {
 int
 nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
            unsigned int flags, void *data) {
-    int rv = -1;
-    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    uint64_t t0 = stats_now();
+    int rv = -ENOTTY;
+    handle *hh;
+    // cmd comes in as an int, and the _IOWR ones have the top bit set
+    unsigned int ucmd = cmd;
+    if (statsPath(path) == 1 && cmd == NUFS_IOC_STATS_RESET) {
+        stats_reset();
+        rv = 0;
+    } else if (ucmd == NUFS_IOC_SEEK_DATA || ucmd == NUFS_IOC_SEEK_HOLE) {
+        int64_t *pos = data;
+        rv = fileToINum(path, fi, &hh);
+        if (rv >= 0) {
+            off_t found = ops_seek(rv, *pos, (ucmd == NUFS_IOC_SEEK_DATA) ? SEEK_DATA : SEEK_HOLE);
+            if (found >= 0) {
+                *pos = found;
+            }
+            rv = (found < 0) ? found : 0;
+        }
+    }
+    TRACE(TR_OPS, TR_INFO, "ioctl(%s, %d, ...) -> %d", path, cmd, rv);
+    stats_op(OP_IOCTL, t0, rv);
     return rv;
 }
 
-const int symLinkModeNumber = 0120000;
-
 int nufs_symlink(const char *to, const char *from) {
+    uint64_t t0 = stats_now();
 
     if (strlen(from) == 0 || strlen(to) == 0) {
-        perror("to or from is too short in symlink");
+        TRACE(TR_OPS, TR_ERR, "symlink to %s from %s: empty name", to, from);
+        stats_op(OP_SYMLINK, t0, -ENOENT);
         return -ENOENT;
     }
 
-    int rv = -1;
-    rv = nufs_mknod(from, symLinkModeNumber, 0);
-    if (rv != 0) {
-        perror("symLink creating not sucessful");
-        return -1;
-    }
-
-    printf("length of to is %lu", strlen(to));
-    rv = nufs_write(from, to, strlen(to), 0, 0);
-    if (rv <= 0) {
-        rv = -1;
-    } else {
-        rv = 0;
+    int parentNum;
+    const char *fileName;
+    int inum;
+    int rv = pathToParent(from, &parentNum, &fileName);
+    if (rv == 0) {
+        rv = ops_symlink(parentNum, fileName, from, to, &inum);
     }
 
-    printf("symlink to %s from %s -> %i\n", to, from, rv);
+    TRACE(TR_OPS, TR_INFO, "symlink to %s from %s -> %i", to, from, rv);
+    stats_op(OP_SYMLINK, t0, rv);
     return rv;
 }
 
 
 int nufs_readlink(const char *path, char *buf, size_t size) {
-    int rv = -1;
+    uint64_t t0 = stats_now();
+    TRACE(TR_OPS, TR_DEBUG, "size in readLink %zu", size);
 
-    printf("size in readLink %zu\n", size);
+    int rv = pathToINum(path);
+    if (rv >= 0) {
+        rv = ops_readlink(rv, buf, size);
+    }
 
-    rv = nufs_read(path, buf, size, 0, 0);
+    TRACE(TR_OPS, TR_INFO, "readLinek path %s size %zu -> -%i", path, size, rv);
+    stats_op(OP_READLINK, t0, rv);
+    return rv;
+}
 
-    rv = 0;
-    printf("readLinek path %s size %zu -> -%i\n", path, size, rv);
+int
+nufs_fallocate(const char *path, int mode, off_t offset, off_t length,
+               struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    handle *hh;
+    int rv = fileToINum(path, fi, &hh);
+    if (rv >= 0) {
+        rv = ops_fallocate(rv, mode, offset, length);
+    }
+    TRACE(TR_OPS, TR_INFO, "fallocate(%s, %x, %ld bytes, @+%ld) -> %d", path, mode, length, offset, rv);
+    stats_op(OP_FALLOCATE, t0, rv);
     return rv;
 }
 
+int nufs_statfs(const char *path, struct statvfs *st) {
+    uint64_t t0 = stats_now();
+    ops_statfs(st);
+    TRACE(TR_OPS, TR_INFO, "statfs(%s) -> %lu free of %lu", path, st->f_bfree, st->f_blocks);
+    stats_op(OP_STATFS, t0, 0);
+    return 0;
+}
+
+// FUSE has forked into the background by now, so threads we start stay
+void *
+nufs_init(struct fuse_conn_info *conn) {
+    // without big_writes every write() arrives as 4K requests
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+    conn->max_write = NUFS_MAX_WRITE;
+    trace_start();
+    reclaim_start();
+    return NULL;
+}
+
+void
+nufs_destroy(void *private_data) {
+    reclaim_stop();
+    trace_stop();
+}
+
 void
 nufs_init_ops(struct fuse_operations *ops) {
     memset(ops, 0, sizeof(struct fuse_operations));
+    ops->init = nufs_init;
+    ops->destroy = nufs_destroy;
     ops->access = nufs_access;
     ops->getattr = nufs_getattr;
     ops->readdir = nufs_readdir;
@@ -1082,21 +581,64 @@ nufs_init_ops(struct fuse_operations *ops) {
     ops->chmod = nufs_chmod;
     ops->truncate = nufs_truncate;
     ops->open = nufs_open;
+    ops->flush = nufs_flush;
+    ops->release = nufs_release;
     ops->read = nufs_read;
     ops->write = nufs_write;
+    ops->write_buf = nufs_write_buf;
     ops->utimens = nufs_utimens;
     ops->ioctl = nufs_ioctl;
     ops->readlink = nufs_readlink;
     ops->symlink = nufs_symlink;
+    ops->statfs = nufs_statfs;
+    ops->fallocate = nufs_fallocate;
 };
 
 struct fuse_operations nufs_ops;
 
+// -o strictatime, relatime (the default) or noatime pick how reads update
+// atimes. They're for us rather than the kernel, so they stop here.
+static const struct fuse_opt nufs_opts[] = {
+        FUSE_OPT_KEY("strictatime", ATIME_STRICT),
+        FUSE_OPT_KEY("relatime", ATIME_RELATIME),
+        FUSE_OPT_KEY("noatime", ATIME_NOATIME),
+        FUSE_OPT_END
+};
+
+static int
+nufs_opt(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_OPT || key == FUSE_OPT_KEY_NONOPT) {
+        return 1;
+    }
+    ops_set_atime(key);
+    return 0;
+}
+
 int
 main(int argc, char *argv[]) {
-    assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc]);
+    // --lowlevel serves inode numbers to the kernel instead of paths
+    int lowlevel = 0;
+    for (int ii = 1; ii < argc; ++ii) {
+        if (strcmp(argv[ii], "--lowlevel") == 0) {
+            lowlevel = 1;
+            memmove(&argv[ii], &argv[ii + 1], (argc - ii) * sizeof(char *));
+            --argc;
+            break;
+        }
+    }
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, NULL, nufs_opts, nufs_opt) != 0) {
+        return 1;
+    }
+
+    assert(args.argc > 2);
+    trace_init(NULL);
+    storage_init(args.argv[--args.argc]);
+    if (lowlevel) {
+        return nufs_ll_main(args.argc, args.argv);
+    }
     nufs_init_ops(&nufs_ops);
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    return fuse_main(args.argc, args.argv, &nufs_ops, NULL);
 }
 
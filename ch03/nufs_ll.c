@@ -0,0 +1,570 @@
+// Low-level FUSE front end.
+//
+// The kernel hands us inode numbers it got from an earlier lookup, so no
+// operation here walks a path: ino is just our inode number plus one
+// (FUSE_ROOT_ID is 1 and the root is inode 0), and the work is done by
+// the same ops_* functions the path front end uses.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+
+#include "nufs_ll.h"
+#include "ops.h"
+#include "inode.h"
+#include "directory.h"
+#include "handle.h"
+#include "trace.h"
+#include "stats.h"
+#include "reclaim.h"
+
+// how long the kernel may keep names and attributes without asking again;
+// nothing but us changes the image
+static const double LL_TIMEOUT = 1.0;
+
+static int ll_inum(fuse_ino_t ino) {
+    return (int) ino - 1;
+}
+
+// Lookup counts. Every entry we reply with is one more reference the
+// kernel holds until it forgets it, and an inode that loses its last name
+// while the kernel still knows it (an open file, say) has to stay around
+// until then. It waits on the orphan list, held, so it isn't leaked if we
+// never hear the forget.
+#define LL_REFS 1024
+
+typedef struct ll_ref {
+    int inum;
+    unsigned long nlookup;
+    int orphan; // no names left, held on the orphan list until the last forget
+    struct ll_ref *next;
+} ll_ref;
+
+static ll_ref *ll_refs[LL_REFS];
+static pthread_mutex_t ll_refs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ll_ref **ll_ref_find(int inum) {
+    ll_ref **pp = &ll_refs[inum % LL_REFS];
+    while (*pp && (*pp)->inum != inum) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+static void ll_remember(int inum) {
+    pthread_mutex_lock(&ll_refs_lock);
+    ll_ref **pp = ll_ref_find(inum);
+    if (*pp == NULL) {
+        ll_ref *ref = calloc(1, sizeof(ll_ref));
+        ref->inum = inum;
+        *pp = ref;
+    }
+    (*pp)->nlookup++;
+    pthread_mutex_unlock(&ll_refs_lock);
+}
+
+static void ll_forget_inum(int inum, unsigned long nlookup) {
+    int release = 0;
+    pthread_mutex_lock(&ll_refs_lock);
+    ll_ref **pp = ll_ref_find(inum);
+    ll_ref *ref = *pp;
+    if (ref != NULL) {
+        ref->nlookup -= (nlookup < ref->nlookup) ? nlookup : ref->nlookup;
+        if (ref->nlookup == 0) {
+            release = ref->orphan;
+            *pp = ref->next;
+            free(ref);
+        }
+    }
+    pthread_mutex_unlock(&ll_refs_lock);
+
+    if (release) {
+        reclaim_release(inum);
+    }
+}
+
+// The last name of inum is gone: free it now, or hold it on the orphan
+// list until the kernel forgets it.
+static void ll_orphan(int inum) {
+    int evict = 1;
+    pthread_mutex_lock(&ll_refs_lock);
+    ll_ref *ref = *ll_ref_find(inum);
+    if (ref != NULL) {
+        // before a forget can see orphan set and release it
+        reclaim_hold(inum);
+        ref->orphan = 1;
+        evict = 0;
+    }
+    pthread_mutex_unlock(&ll_refs_lock);
+
+    if (evict) {
+        ops_evict(inum);
+    }
+}
+
+static void ll_reply_entry(fuse_req_t req, int inum) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.ino = inum + 1;
+    e.attr_timeout = LL_TIMEOUT;
+    e.entry_timeout = LL_TIMEOUT;
+    ops_stat(inum, &e.attr);
+
+    ll_remember(inum);
+    if (fuse_reply_entry(req, &e) != 0) {
+        // the request was interrupted, so the kernel never got it
+        ll_forget_inum(inum, 1);
+    }
+}
+
+static void ll_reply_created(fuse_req_t req, int rv, int inum) {
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        ll_reply_entry(req, inum);
+    }
+}
+
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    uint64_t t0 = stats_now();
+    inode *dd = get_inode(ll_inum(parent));
+    inode_rdlock(dd);
+    int inum = S_ISDIR(dd->mode) ? directory_lookup_inode(dd, name) : -ENOTDIR;
+    inode_unlock(dd);
+
+    TRACE(TR_OPS, TR_INFO, "ll lookup(%lu, %s) -> %d", parent, name, inum);
+    if (inum == -ENOTDIR) {
+        fuse_reply_err(req, ENOTDIR);
+    } else if (inum < 0) {
+        fuse_reply_err(req, ENOENT);
+    } else {
+        ll_reply_entry(req, inum);
+    }
+    stats_op(OP_LOOKUP, t0, inum);
+}
+
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    uint64_t t0 = stats_now();
+    if (ino != FUSE_ROOT_ID) {
+        ll_forget_inum(ll_inum(ino), nlookup);
+    }
+    fuse_reply_none(req);
+    stats_op(OP_FORGET, t0, 0);
+}
+
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    struct stat st;
+    ops_stat(ll_inum(ino), &st);
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+    stats_op(OP_GETATTR, t0, 0);
+}
+
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int inum = ll_inum(ino);
+    int rv = 0;
+
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        rv = ops_chmod(inum, attr->st_mode);
+    }
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        rv = ops_truncate(inum, attr->st_size);
+    }
+    if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME |
+                              FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))) {
+        // whichever time isn't being set keeps what it had
+        struct timespec ts[2] = {{0, UTIME_OMIT}, {0, UTIME_OMIT}};
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            ts[0].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_ATIME) {
+            ts[0] = attr->st_atim;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            ts[1].tv_nsec = UTIME_NOW;
+        } else if (to_set & FUSE_SET_ATTR_MTIME) {
+            ts[1] = attr->st_mtim;
+        }
+        rv = ops_utimens(inum, ts);
+    }
+
+    TRACE(TR_OPS, TR_INFO, "ll setattr(%lu, %x) -> %d", ino, to_set, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        stats_op(OP_SETATTR, t0, rv);
+        return;
+    }
+    struct stat st;
+    ops_stat(inum, &st);
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+    stats_op(OP_SETATTR, t0, rv);
+}
+
+static void nufs_ll_readlink(fuse_req_t req, fuse_ino_t ino) {
+    uint64_t t0 = stats_now();
+    char buf[PATH_MAX + 1];
+    int rv = ops_readlink(ll_inum(ino), buf, sizeof(buf));
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_readlink(req, buf);
+    }
+    stats_op(OP_READLINK, t0, rv);
+}
+
+static void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    uint64_t t0 = stats_now();
+    struct statvfs st;
+    ops_statfs(&st);
+    fuse_reply_statfs(req, &st);
+    stats_op(OP_STATFS, t0, 0);
+}
+
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+    uint64_t t0 = stats_now();
+    int inum;
+    int rv = ops_create(ll_inum(parent), name, NULL, mode, &inum);
+    TRACE(TR_OPS, TR_INFO, "ll mknod(%lu, %s, %04o) -> %d", parent, name, mode, rv);
+    ll_reply_created(req, rv, inum);
+    stats_op(OP_MKNOD, t0, rv);
+}
+
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    uint64_t t0 = stats_now();
+    int inum;
+    int rv = ops_create(ll_inum(parent), name, NULL, mode | S_IFDIR, &inum);
+    TRACE(TR_OPS, TR_INFO, "ll mkdir(%lu, %s, %04o) -> %d", parent, name, mode, rv);
+    ll_reply_created(req, rv, inum);
+    stats_op(OP_MKDIR, t0, rv);
+}
+
+static void nufs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                            const char *name) {
+    uint64_t t0 = stats_now();
+    int inum;
+    int rv = ops_symlink(ll_inum(parent), name, NULL, link, &inum);
+    TRACE(TR_OPS, TR_INFO, "ll symlink(%lu, %s -> %s) -> %d", parent, name, link, rv);
+    ll_reply_created(req, rv, inum);
+    stats_op(OP_SYMLINK, t0, rv);
+}
+
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+    uint64_t t0 = stats_now();
+    int inum = ll_inum(ino);
+    int rv = ops_link(inum, ll_inum(newparent), newname, NULL);
+    TRACE(TR_OPS, TR_INFO, "ll link(%lu => %lu, %s) -> %d", ino, newparent, newname, rv);
+    ll_reply_created(req, rv, inum);
+    stats_op(OP_LINK, t0, rv);
+}
+
+// Drop a name with ulink(), freeing the inode if it was the last one and
+// the kernel doesn't know about it anymore
+static void nufs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           int (*ulink)(int, const char *, const char *, int *), int op) {
+    uint64_t t0 = stats_now();
+    int inum;
+    int rv = ulink(ll_inum(parent), name, NULL, &inum);
+    if (rv == 1) {
+        ll_orphan(inum);
+    }
+    TRACE(TR_OPS, TR_INFO, "ll remove(%lu, %s) -> %d", parent, name, rv);
+    fuse_reply_err(req, (rv < 0) ? -rv : 0);
+    stats_op(op, t0, rv);
+}
+
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    nufs_ll_remove(req, parent, name, ops_unlink, OP_UNLINK);
+}
+
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    nufs_ll_remove(req, parent, name, ops_rmdir, OP_RMDIR);
+}
+
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+    uint64_t t0 = stats_now();
+    int rv = ops_rename(ll_inum(parent), name, NULL, ll_inum(newparent), newname, NULL);
+    TRACE(TR_OPS, TR_INFO, "ll rename(%lu, %s => %lu, %s) -> %d", parent, name, newparent, newname, rv);
+    fuse_reply_err(req, -rv);
+    stats_op(OP_RENAME, t0, rv);
+}
+
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int inum = ll_inum(ino);
+    fi->fh = handle_open(inum, fi->flags);
+    if (fuse_reply_open(req, fi) != 0) {
+        handle_close(fi->fh);
+    }
+    stats_op(OP_OPEN, t0, 0);
+}
+
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    // writes went straight into the image
+    fuse_reply_err(req, 0);
+    stats_op(OP_FLUSH, t0, 0);
+}
+
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    handle_close(fi->fh);
+    fuse_reply_err(req, 0);
+    stats_op(OP_RELEASE, t0, 0);
+}
+
+// fuse_reply_data() for ops_read_buf(), which doesn't always get that far
+typedef struct ll_read {
+    fuse_req_t req;
+    int replied;
+} ll_read;
+
+static int ll_reply_data(void *arg, struct fuse_bufvec *bv) {
+    ll_read *rd = arg;
+    rd->replied = 1;
+    return fuse_reply_data(rd->req, bv, 0);
+}
+
+// The reply goes out while the file is still locked, straight from the
+// image file.
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    ll_read rd = {req, 0};
+    int rv = ops_read_buf(ll_inum(ino), size, off, handle_get(fi->fh), ll_reply_data, &rd);
+    if (!rd.replied) {
+        fuse_reply_err(req, -rv);
+    }
+    stats_op(OP_READ, t0, rv);
+}
+
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+                          off_t off, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int rv = ops_write(ll_inum(ino), buf, size, off, handle_get(fi->fh));
+    TRACE(TR_OPS, TR_INFO, "ll write(%lu, %ld bytes, @+%ld) -> %d", ino, size, off, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+    stats_op(OP_WRITE, t0, rv);
+}
+
+static void nufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int rv = ops_write_buf(ll_inum(ino), bufv, off, handle_get(fi->fh));
+    TRACE(TR_OPS, TR_INFO, "ll write_buf(%lu, %ld bytes, @+%ld) -> %d", ino, fuse_buf_size(bufv), off, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+    stats_op(OP_WRITE, t0, rv);
+}
+
+static void nufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset,
+                              off_t length, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int rv = ops_fallocate(ll_inum(ino), mode, offset, length);
+    TRACE(TR_OPS, TR_INFO, "ll fallocate(%lu, %x, %ld bytes, @+%ld) -> %d", ino, mode, length, offset, rv);
+    fuse_reply_err(req, -rv);
+    stats_op(OP_FALLOCATE, t0, rv);
+}
+
+// Only the lseek(SEEK_DATA / SEEK_HOLE) stand-ins, see ops.h.
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags,
+                          const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    uint64_t t0 = stats_now();
+    unsigned int ucmd = cmd;
+    int64_t pos = 0;
+    off_t rv = -ENOTTY;
+    if ((ucmd == NUFS_IOC_SEEK_DATA || ucmd == NUFS_IOC_SEEK_HOLE) && in_bufsz == sizeof(pos)) {
+        memcpy(&pos, in_buf, sizeof(pos));
+        rv = ops_seek(ll_inum(ino), pos, (ucmd == NUFS_IOC_SEEK_DATA) ? SEEK_DATA : SEEK_HOLE);
+    }
+    TRACE(TR_OPS, TR_INFO, "ll ioctl(%lu, %x, @+%ld) -> %ld", ino, ucmd, pos, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        pos = rv;
+        fuse_reply_ioctl(req, 0, &pos, sizeof(pos));
+    }
+    stats_op(OP_IOCTL, t0, (rv < 0) ? rv : 0);
+}
+
+// A directory listing is built once at opendir, in the kernel's format,
+// and readdir hands out pieces of it by offset.
+typedef struct ll_dirbuf {
+    fuse_req_t req;
+    char *data;
+    size_t size;
+    size_t cap;
+} ll_dirbuf;
+
+static int ll_dirbuf_add(void *arg, const char *name, int inum) {
+    ll_dirbuf *db = arg;
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_ino = inum + 1;
+    // the type bits never change, and the entry can't go away while we
+    // hold the directory
+    st.st_mode = get_inode(inum)->mode & S_IFMT;
+
+    size_t len = fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+    if (db->size + len > db->cap) {
+        db->cap = (db->cap == 0) ? 4096 : db->cap * 2;
+        while (db->size + len > db->cap) {
+            db->cap *= 2;
+        }
+        db->data = realloc(db->data, db->cap);
+    }
+    fuse_add_direntry(db->req, db->data + db->size, len, name, &st, db->size + len);
+    db->size += len;
+    return 0;
+}
+
+static void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    int inum = ll_inum(ino);
+    inode *dd = get_inode(inum);
+    if (!S_ISDIR(dd->mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        stats_op(OP_OPENDIR, t0, -ENOTDIR);
+        return;
+    }
+    ops_touch(inum);
+
+    ll_dirbuf *db = calloc(1, sizeof(ll_dirbuf));
+    db->req = req;
+    // we don't keep track of parents, the kernel fills in .. itself
+    ll_dirbuf_add(db, ".", inum);
+    ll_dirbuf_add(db, "..", inum);
+    inode_rdlock(dd);
+    directory_each(dd, ll_dirbuf_add, db);
+    inode_unlock(dd);
+
+    fi->fh = (uintptr_t) db;
+    if (fuse_reply_open(req, fi) != 0) {
+        free(db->data);
+        free(db);
+    }
+    stats_op(OP_OPENDIR, t0, 0);
+}
+
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                            struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    ll_dirbuf *db = (ll_dirbuf *) (uintptr_t) fi->fh;
+    if (off >= db->size) {
+        fuse_reply_buf(req, NULL, 0);
+        stats_op(OP_READDIR, t0, 0);
+        return;
+    }
+    if (size > db->size - off) {
+        size = db->size - off;
+    }
+    fuse_reply_buf(req, db->data + off, size);
+    stats_op(OP_READDIR, t0, 0);
+}
+
+static void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t t0 = stats_now();
+    ll_dirbuf *db = (ll_dirbuf *) (uintptr_t) fi->fh;
+    free(db->data);
+    free(db);
+    fuse_reply_err(req, 0);
+    stats_op(OP_RELEASEDIR, t0, 0);
+}
+
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    // without big_writes every write() arrives as 4K requests
+    conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+    conn->max_write = NUFS_MAX_WRITE;
+}
+
+static void
+nufs_ll_init_ops(struct fuse_lowlevel_ops *ops) {
+    memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+    ops->init = nufs_ll_init;
+    ops->lookup = nufs_ll_lookup;
+    ops->forget = nufs_ll_forget;
+    ops->getattr = nufs_ll_getattr;
+    ops->setattr = nufs_ll_setattr;
+    ops->readlink = nufs_ll_readlink;
+    ops->mknod = nufs_ll_mknod;
+    ops->mkdir = nufs_ll_mkdir;
+    ops->unlink = nufs_ll_unlink;
+    ops->rmdir = nufs_ll_rmdir;
+    ops->symlink = nufs_ll_symlink;
+    ops->rename = nufs_ll_rename;
+    ops->link = nufs_ll_link;
+    ops->open = nufs_ll_open;
+    ops->flush = nufs_ll_flush;
+    ops->release = nufs_ll_release;
+    ops->read = nufs_ll_read;
+    ops->write = nufs_ll_write;
+    ops->write_buf = nufs_ll_write_buf;
+    ops->opendir = nufs_ll_opendir;
+    ops->readdir = nufs_ll_readdir;
+    ops->releasedir = nufs_ll_releasedir;
+    ops->statfs = nufs_ll_statfs;
+    ops->fallocate = nufs_ll_fallocate;
+    ops->ioctl = nufs_ll_ioctl;
+}
+
+static struct fuse_lowlevel_ops nufs_ll_ops;
+
+int
+nufs_ll_main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0) {
+        return 1;
+    }
+
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL) {
+        perror("fuse_mount");
+        return 1;
+    }
+
+    int rv = 1;
+    nufs_ll_init_ops(&nufs_ll_ops);
+    struct fuse_session *se = fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) == 0) {
+            fuse_session_add_chan(se, ch);
+            fuse_daemonize(foreground);
+            trace_start();
+            reclaim_start();
+            rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+            reclaim_stop();
+            trace_stop();
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    fuse_opt_free_args(&args);
+    return rv ? 1 : 0;
+}
@@ -0,0 +1,9 @@
+// Low-level FUSE front end, keyed on inode numbers instead of paths.
+
+#ifndef NUFS_LL_H
+#define NUFS_LL_H
+
+// Mounts and serves the already opened image until unmounted.
+int nufs_ll_main(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,757 @@
+// Filesystem operations keyed on inode numbers, shared by both front ends.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <linux/falloc.h>
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_common.h>
+
+#include "ops.h"
+#include "pages.h"
+#include "util.h"
+#include "inode.h"
+#include "directory.h"
+#include "dcache.h"
+#include "handle.h"
+#include "reclaim.h"
+#include "trace.h"
+
+static const size_t PAGE_SIZE = 4096;
+
+static const char zeros[4096]; // what a read sees where a file has no page
+
+static const int64_t NSEC = 1000000000L;
+
+static int atime_mode = ATIME_RELATIME;
+
+static int64_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+static struct timespec to_timespec(int64_t ns) {
+    struct timespec ts = {ns / NSEC, ns % NSEC};
+    return ts;
+}
+
+void ops_set_atime(int mode) {
+    atime_mode = mode;
+}
+
+void ops_stat(int inum, struct stat *st) {
+    inode *fptr = get_inode(inum);
+    memset(st, 0, sizeof(struct stat));
+    inode_rdlock(fptr);
+    st->st_dev = 1; //arbitrary
+    st->st_ino = inum + 1;
+    st->st_mode = fptr->mode;
+    st->st_nlink = 1; //not doing this yet
+    st->st_uid = getuid();
+    st->st_gid = getgid(); //group id
+    st->st_rdev = 0;
+    st->st_size = fptr->size;
+    st->st_blksize = 4096;
+    // 512 byte units, and only what's really there, so holes don't count
+    st->st_blocks = (fptr->flags & INODE_IS_INLINE) ? 0 : (blkcnt_t) fptr->pages * 8;
+    st->st_ctim = to_timespec(fptr->creation_time);
+    // with no names left, last_view is its place on the orphan list
+    int64_t atime = (fptr->refs == 0) ? fptr->last_change
+                                      : __atomic_load_n(&fptr->last_view, __ATOMIC_RELAXED);
+    st->st_atim = to_timespec(atime);
+    st->st_mtim = to_timespec(fptr->last_change);
+    inode_unlock(fptr);
+}
+
+// Set up a fresh inode nobody can see yet. Returns its number or -errno.
+static int new_inode(mode_t mode) {
+    // word-at-a-time search from where the last one left off, and the
+    // table grows when it's full
+    int inum = alloc_inode();
+    if (inum < 0) {
+        TRACE(TR_INODE, TR_ERR, "MKNOD FAILED");
+        return -ENOSPC;
+    }
+
+    //found free spot, set empty inode info
+    int64_t tt = now();
+    inode *node = get_inode(inum);
+    node->refs = 1;
+    node->mode = mode;
+    node->size = 0;
+    node->pages = 0;
+    node->depth = 0;
+    node->nexts = 0;
+    node->flags = inode_can_inline(node) ? INODE_IS_INLINE : 0;
+    node->creation_time = tt;
+    node->last_change = tt;
+    node->last_view = tt;
+
+    // a directory is set up before anyone can find it
+    if (S_ISDIR(mode) && directory_setup(node) < 0) {
+        free_inode(inum);
+        return -ENOSPC;
+    }
+    return inum;
+}
+
+// Give a new inode its name in parent, or throw it away if that fails.
+// path is the whole name for the dcache, or NULL if there isn't one.
+static int publish(int parent, const char *name, int inum, const char *path) {
+    int rv = 0;
+    inode *dirPtr = get_inode(parent);
+    inode_wrlock(dirPtr);
+    if (!S_ISDIR(dirPtr->mode)) {
+        rv = -ENOTDIR;
+    } else if (dirPtr->refs == 0) {
+        // rmdir'd since we found it
+        rv = -ENOENT;
+    } else if (directory_lookup_inode(dirPtr, name) >= 0) {
+        // someone else made it since we looked
+        rv = -EEXIST;
+    } else if (directory_put(dirPtr, name, inum) < 0) {
+        // no room to grow the directory
+        rv = -ENOSPC;
+    } else {
+        dirPtr->last_change = now();
+        if (path != NULL) {
+            dcache_insert(path, inum);
+        }
+    }
+    inode_unlock(dirPtr);
+
+    if (rv < 0) {
+        // the inode goes back
+        ops_evict(inum);
+    }
+    return rv;
+}
+
+// makes a filesystem object like a file or directory
+int ops_create(int parent, const char *name, const char *path, mode_t mode, int *inum) {
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    int ii = new_inode(mode);
+    if (ii < 0) {
+        return ii;
+    }
+    int rv = publish(parent, name, ii, path);
+    if (rv == 0) {
+        *inum = ii;
+    }
+    return rv;
+}
+
+// A symlink is a small file holding its target.
+int ops_symlink(int parent, const char *name, const char *path, const char *target,
+                int *inum) {
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    int ii = new_inode(S_IFLNK | 0777);
+    if (ii < 0) {
+        return ii;
+    }
+    int len = strlen(target);
+    if (ops_write(ii, target, len, 0, NULL) != len) {
+        ops_evict(ii);
+        return -ENOSPC;
+    }
+    int rv = publish(parent, name, ii, path);
+    if (rv == 0) {
+        *inum = ii;
+    }
+    return rv;
+}
+
+int ops_link(int inum, int parent, const char *name, const char *path) {
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    inode *toDir = get_inode(parent);
+    inode_wrlock(toDir);
+    int rv = 0;
+    if (toDir->refs == 0) {
+        rv = -ENOENT;
+    } else if (directory_lookup_inode(toDir, name) >= 0) {
+        rv = -EEXIST;
+    } else if (directory_put(toDir, name, inum) < 0) {
+        rv = -ENOSPC;
+    } else {
+        toDir->last_change = now();
+        if (path != NULL) {
+            dcache_insert(path, inum);
+        }
+    }
+    inode_unlock(toDir);
+
+    if (rv == 0) {
+        inode *file = get_inode(inum);
+        inode_wrlock(file);
+        file->refs++;
+        inode_unlock(file);
+    }
+    return rv;
+}
+
+// Take the name out of parent and drop the inode's link count, with both
+// locked the whole time, so what's checked is what goes. With wantDir it
+// has to be an empty directory: nothing can be made in it while it's
+// locked, and once it's gone its refs of 0 keeps anything else out.
+static int remove_name(int parent, const char *name, const char *path, int wantDir,
+                       int *inum) {
+    inode *dirPtr = get_inode(parent);
+    while (1) {
+        inode_rdlock(dirPtr);
+        int inodeNum = directory_lookup_inode(dirPtr, name);
+        inode_unlock(dirPtr);
+        if (inodeNum < 0) {
+            return -ENOENT;
+        }
+
+        inode *fileptr = get_inode(inodeNum);
+        inode_wrlock2(dirPtr, fileptr);
+        if (directory_lookup_inode(dirPtr, name) != inodeNum) {
+            // renamed or replaced while nothing was locked
+            inode_unlock2(dirPtr, fileptr);
+            continue;
+        }
+
+        int rv = 0;
+        if (wantDir && !S_ISDIR(fileptr->mode)) {
+            rv = -ENOTDIR;
+        } else if (wantDir && !directory_is_empty(fileptr)) {
+            rv = -ENOTEMPTY;
+        } else {
+            // the name goes even if other links keep the inode alive
+            directory_delete(dirPtr, name);
+            int64_t tt = now();
+            dirPtr->last_change = tt;
+            if (path != NULL) {
+                dcache_insert(path, -1);
+            }
+            fileptr->last_change = tt;
+            fileptr->refs--;
+            rv = (fileptr->refs == 0);
+            *inum = inodeNum;
+        }
+        inode_unlock2(dirPtr, fileptr);
+        return rv;
+    }
+}
+
+// Take the name out of parent and drop the inode's link count. Returns 1
+// if that was its last name, in which case the caller ops_evict()s it once
+// nothing else is using it, 0 if it has others, or -errno.
+int ops_unlink(int parent, const char *name, const char *path, int *inum) {
+    return remove_name(parent, name, path, 0, inum);
+}
+
+// Like ops_unlink(), for an empty directory.
+int ops_rmdir(int parent, const char *name, const char *path, int *inum) {
+    return remove_name(parent, name, path, 1, inum);
+}
+
+// Free an inode that has no names left, and its pages. That happens in
+// the background, so this doesn't wait for a big file's pages to go.
+void ops_evict(int inum) {
+    reclaim_push(inum);
+}
+
+// called to move a file within the same filesystem
+int ops_rename(int fromParent, const char *fromName, const char *fromPath,
+               int toParent, const char *toName, const char *toPath) {
+    if (strlen(toName) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    inode *dirInodeFrom = get_inode(fromParent);
+    inode *dirInodeTo = get_inode(toParent);
+    inode_wrlock2(dirInodeFrom, dirInodeTo);
+
+    // from directory has the file, to directory does not
+    int fromINode = directory_lookup_inode(dirInodeFrom, fromName);
+    int toINode = directory_lookup_inode(dirInodeTo, toName);
+    if (!(fromINode >= 0 && toINode < 0) || dirInodeTo->refs == 0) {
+        inode_unlock2(dirInodeFrom, dirInodeTo);
+        return (fromINode < 0 || dirInodeTo->refs == 0) ? -ENOENT : -EEXIST;
+    }
+
+    int64_t tt = now();
+    dirInodeFrom->last_change = tt;
+    dirInodeTo->last_change = tt;
+
+    // put the new name first, so a full directory doesn't lose the file
+    int rv = 0;
+    if (directory_put(dirInodeTo, toName, fromINode) < 0) {
+        TRACE(TR_DIR, TR_ERR, "Rename - directory_put failed");
+        rv = -ENOSPC;
+    } else if (directory_delete(dirInodeFrom, fromName) < 0) {
+        TRACE(TR_DIR, TR_ERR, "Rename - directory_delete failed");
+        rv = -EIO;
+    }
+    if (rv != -ENOSPC && fromPath != NULL) {
+        // a directory takes everything under it along
+        dcache_invalidate_tree(fromPath);
+        dcache_invalidate_tree(toPath);
+    }
+    inode_unlock2(dirInodeFrom, dirInodeTo);
+    return rv;
+}
+
+int ops_truncate(int inum, off_t size) {
+    inode *fptr = get_inode(inum);
+    inode_wrlock(fptr);
+    TRACE(TR_DATA, TR_DEBUG, "currNodeSize: %ld and size %li", fptr->size, size);
+
+    int rv = 0;
+    if (size > fptr->size) {
+        // no pages, the new part is a hole until something's written there
+        if (extend_inode(fptr, size) < 0) {
+            rv = -ENOSPC;
+        }
+    } else {
+        // only the extents past the new end are visited and freed,
+        // fallocate'd ones too, and extend_inode() zeroes the partial
+        // last page if the file gets longer again
+        shrink_inode(fptr, size);
+    }
+    fptr->last_change = now();
+    inode_unlock(fptr);
+    return rv;
+}
+
+int ops_chmod(int inum, mode_t mode) {
+    inode *node = get_inode(inum);
+    inode_wrlock(node);
+    // only the permission bits, it stays the same type of thing
+    node->mode = (node->mode & S_IFMT) | (mode & ~S_IFMT);
+    node->last_change = now();
+    inode_unlock(node);
+    return 0;
+}
+
+// ts[0] is the atime, ts[1] the mtime. Either can be UTIME_NOW or
+// UTIME_OMIT in tv_nsec, like utimensat().
+int ops_utimens(int inum, const struct timespec ts[2]) {
+    int64_t tt = now();
+    int64_t set[2];
+    for (int ii = 0; ii < 2; ++ii) {
+        if (ts[ii].tv_nsec == UTIME_NOW) {
+            set[ii] = tt;
+        } else {
+            set[ii] = ts[ii].tv_sec * NSEC + ts[ii].tv_nsec;
+        }
+    }
+
+    inode *thing = get_inode(inum);
+    inode_wrlock(thing);
+    if (ts[0].tv_nsec != UTIME_OMIT && thing->refs > 0) {
+        thing->last_view = set[0];
+    }
+    if (ts[1].tv_nsec != UTIME_OMIT) {
+        thing->last_change = set[1];
+    }
+    inode_unlock(thing);
+    return 0;
+}
+
+// Something read the file or listed the directory. Whether that's worth
+// writing to the inode's page depends on the atime mode: relatime only
+// does it when the atime would otherwise look older than the last change,
+// or is a day old. Callers hold at least the read lock, so other readers
+// can be doing the same. Unlinked files that are still open keep their
+// orphan list link there instead, so they're left alone.
+static void touch_atime(inode *node) {
+    if (atime_mode == ATIME_NOATIME || node->refs == 0) {
+        return;
+    }
+    int64_t tt = now();
+    int64_t atime = __atomic_load_n(&node->last_view, __ATOMIC_RELAXED);
+    if (atime_mode == ATIME_RELATIME && atime > node->last_change &&
+        atime > node->creation_time && tt - atime < 24 * 3600 * NSEC) {
+        return;
+    }
+    __atomic_store_n(&node->last_view, tt, __ATOMIC_RELAXED);
+}
+
+void ops_touch(int inum) {
+    inode *node = get_inode(inum);
+    inode_rdlock(node);
+    touch_atime(node);
+    inode_unlock(node);
+}
+
+// Copy size bytes at offset out of the file, one memcpy per physically
+// contiguous run of pages.
+static int read_pages(inode *fptr, char *buf, size_t size, off_t offset, inode_cursor *cur) {
+    TRACE(TR_DATA, TR_DEBUG, "Reading in size and offset %zu %li ", size, offset);
+    if (offset >= fptr->size) {
+        return 0;
+    }
+    if (offset + size > fptr->size) {
+        size = fptr->size - offset;
+    }
+
+    if (fptr->flags & INODE_IS_INLINE) {
+        memcpy(buf, fptr->data + offset, size);
+        return size;
+    }
+
+    size_t sizeRead = 0;
+    while (sizeRead < size) {
+        off_t pos = offset + sizeRead;
+        size_t inPage = pos % PAGE_SIZE;
+        int run;
+        int flags;
+        int pnum = inode_get_run(fptr, pos / PAGE_SIZE, &run, &flags, cur);
+        size_t num_to_Read = run * PAGE_SIZE - inPage;
+        if (num_to_Read > size - sizeRead) {
+            num_to_Read = size - sizeRead;
+        }
+
+        if (pnum == 0 || (flags & EXT_UNWRITTEN)) {
+            memset(buf + sizeRead, 0, num_to_Read);
+        } else {
+            memcpy(buf + sizeRead, pages_get_page(pnum) + inPage, num_to_Read);
+        }
+        sizeRead += num_to_Read;
+    }
+    return sizeRead;
+}
+
+// hh, if there is one, remembers where in the file this left off.
+int ops_read(int inum, char *buf, size_t size, off_t offset, handle *hh) {
+    inode_cursor cur;
+    if (hh != NULL) {
+        cur = handle_cursor(hh);
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_rdlock(fptr);
+    touch_atime(fptr);
+    int rv = read_pages(fptr, buf, size, offset, hh ? &cur : NULL);
+    inode_unlock(fptr);
+
+    if (hh != NULL) {
+        handle_set_cursor(hh, cur);
+    }
+    return rv;
+}
+
+// Copy size bytes into the file at offset after making sure every page in
+// the span exists. Any offset and length; each physically contiguous run
+// of pages is one memcpy, since the image is mapped in one piece.
+static int write_pages(inode *fptr, const char *buf, size_t size, off_t offset,
+                       inode_cursor *cur) {
+    TRACE(TR_DATA, TR_DEBUG, "TO WRITE %zu with offset %ld", size, offset);
+
+    // get every page we're about to touch in one go, so they come out
+    // of the allocator as contiguous runs rather than one at a time below.
+    // Anything between the old end and offset stays a hole.
+    if (inode_allocate(fptr, offset, size) < 0 || extend_inode(fptr, offset + size) < 0) {
+        return -ENOSPC;
+    }
+
+    // small enough to still live in the inode
+    if (fptr->flags & INODE_IS_INLINE) {
+        memcpy(fptr->data + offset, buf, size);
+        return size;
+    }
+
+    size_t sizeWritten = 0;
+    while (sizeWritten < size) {
+        off_t pos = offset + sizeWritten;
+        size_t inPage = pos % PAGE_SIZE;
+        int run;
+        int flags;
+        int pnum = inode_get_run(fptr, pos / PAGE_SIZE, &run, &flags, cur);
+        if (pnum == 0) {
+            // inode_allocate() said they were all there
+            return -EIO;
+        }
+        size_t num_to_Write = run * PAGE_SIZE - inPage;
+        if (num_to_Write > size - sizeWritten) {
+            num_to_Write = size - sizeWritten;
+        }
+        memcpy(pages_get_page(pnum) + inPage, buf + sizeWritten, num_to_Write);
+        sizeWritten += num_to_Write;
+    }
+    if (inode_mark_written(fptr, offset, sizeWritten) < 0) {
+        return -ENOSPC;
+    }
+    return sizeWritten;
+}
+
+int ops_write(int inum, const char *buf, size_t size, off_t offset, handle *hh) {
+    // nothing to write doesn't grow the file, even past the end
+    if (size == 0) {
+        return 0;
+    }
+    inode_cursor cur;
+    if (hh != NULL) {
+        cur = handle_cursor(hh);
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_wrlock(fptr);
+    int rv = write_pages(fptr, buf, size, offset, hh ? &cur : NULL);
+    if (rv > 0 && offset + size >= fptr->size) {
+        fptr->size = offset + size;
+    }
+    fptr->last_change = now();
+    inode_unlock(fptr);
+
+    if (hh != NULL) {
+        handle_set_cursor(hh, cur);
+    }
+    return rv;
+}
+
+// Reserve pages for [offset, offset + length) so writes there later don't
+// need the allocator. The pages read as zeros until they're written. The
+// file grows to cover the range unless mode has FALLOC_FL_KEEP_SIZE, which
+// is the only flag understood.
+int ops_fallocate(int inum, int mode, off_t offset, off_t length) {
+    if (offset < 0 || length <= 0) {
+        return -EINVAL;
+    }
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_wrlock(fptr);
+    int rv = 0;
+    if (!S_ISREG(fptr->mode)) {
+        rv = -ENODEV;
+    } else if (inode_preallocate(fptr, offset, length) < 0) {
+        rv = -ENOSPC;
+    } else if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > fptr->size) {
+        rv = (extend_inode(fptr, offset + length) < 0) ? -ENOSPC : 0;
+        fptr->last_change = now();
+    }
+    inode_unlock(fptr);
+    return rv;
+}
+
+// Where the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after offset
+// is, like lseek(). Fallocate'd pages that haven't been written count as
+// holes, and there's always one at the end of the file. Only the extents
+// in between are looked at. Returns the offset, or -ENXIO if offset isn't
+// inside the file.
+off_t ops_seek(int inum, off_t offset, int whence) {
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_rdlock(fptr);
+    off_t rv;
+    if (offset < 0 || offset >= fptr->size) {
+        rv = -ENXIO;
+    } else if (fptr->flags & INODE_IS_INLINE) {
+        rv = (whence == SEEK_DATA) ? offset : fptr->size;
+    } else {
+        int fpn = offset / PAGE_SIZE;
+        while ((off_t) fpn * PAGE_SIZE < fptr->size) {
+            int run;
+            int flags;
+            int pnum = inode_get_run(fptr, fpn, &run, &flags, NULL);
+            int isData = pnum != 0 && !(flags & EXT_UNWRITTEN);
+            if (isData == (whence == SEEK_DATA)) {
+                break;
+            }
+            fpn += run;
+        }
+        rv = (off_t) fpn * PAGE_SIZE;
+        if (rv < offset) {
+            rv = offset;
+        }
+        if (rv >= fptr->size) {
+            rv = (whence == SEEK_DATA) ? -ENXIO : fptr->size;
+        }
+    }
+    inode_unlock(fptr);
+    return rv;
+}
+
+// The bytes [offset, offset + size) of the file as buffers, one per
+// physically contiguous run of pages. For reading they're ranges of the
+// image file, so FUSE can splice them, and holes read as zeros. For
+// writing they point into the mapping, and there must be no holes.
+// Returns a malloc'd bufvec, or NULL if a page to write into is missing
+// or there's no memory for it.
+static struct fuse_bufvec *map_span(inode *fptr, size_t size, off_t offset, int forRead,
+                                    inode_cursor *cur) {
+    size_t most = size / PAGE_SIZE + 2;
+    struct fuse_bufvec *bv = calloc(1, sizeof(struct fuse_bufvec) + most * sizeof(struct fuse_buf));
+    if (bv == NULL) {
+        return NULL;
+    }
+    bv->count = 1; // an empty span is one empty buffer
+
+    if (fptr->flags & INODE_IS_INLINE) {
+        bv->buf[0].mem = fptr->data + offset;
+        bv->buf[0].size = size;
+        return bv;
+    }
+
+    struct fuse_buf *last = NULL;
+    int lastEnd = 0; // the page after the last buffer's, 0 after a hole
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t inPage = pos % PAGE_SIZE;
+        int run;
+        int flags;
+        int pnum = inode_get_run(fptr, pos / PAGE_SIZE, &run, &flags, cur);
+        if (pnum == 0 && !forRead) {
+            free(bv);
+            return NULL;
+        }
+        if (forRead && (flags & EXT_UNWRITTEN)) {
+            // fallocate'd and never written: a hole as far as reads go
+            pnum = 0;
+        }
+        if (pnum == 0) {
+            run = 1; // zeros[] is one page
+        }
+        size_t n = run * PAGE_SIZE - inPage;
+        if (n > size - done) {
+            n = size - done;
+        }
+
+        if (last != NULL && pnum != 0 && pnum == lastEnd) {
+            // carries straight on in the image
+            last->size += n;
+        } else {
+            last = &bv->buf[(last == NULL) ? 0 : bv->count++];
+            last->size = n;
+            if (pnum == 0) {
+                last->mem = (void *) zeros;
+            } else if (forRead) {
+                last->flags = FUSE_BUF_IS_FD;
+                last->fd = pages_get_fd();
+                last->pos = (off_t) pnum * PAGE_SIZE + inPage;
+            } else {
+                last->mem = pages_get_page(pnum) + inPage;
+            }
+        }
+        lastEnd = (pnum == 0) ? 0 : pnum + run;
+        done += n;
+    }
+    return bv;
+}
+
+// Like ops_read(), but without copying: reply() gets the data as ranges of
+// the image file. It's called with the inode still locked, so the pages
+// can't be freed out from under it until it's done with them. Returns what
+// reply() did, or -ENOMEM without calling it.
+int ops_read_buf(int inum, size_t size, off_t offset, handle *hh,
+                 int (*reply)(void *arg, struct fuse_bufvec *bv), void *arg) {
+    inode_cursor cur;
+    if (hh != NULL) {
+        cur = handle_cursor(hh);
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_rdlock(fptr);
+    touch_atime(fptr);
+    if (offset >= fptr->size) {
+        size = 0;
+    } else if (offset + size > fptr->size) {
+        size = fptr->size - offset;
+    }
+    struct fuse_bufvec *bv = map_span(fptr, size, offset, 1, hh ? &cur : NULL);
+    int rv = (bv == NULL) ? -ENOMEM : reply(arg, bv);
+    inode_unlock(fptr);
+    free(bv);
+
+    if (hh != NULL) {
+        handle_set_cursor(hh, cur);
+    }
+    return rv;
+}
+
+// Like ops_write(), but src goes straight into the file's pages from
+// wherever it is, which for a spliced request is still the pipe.
+int ops_write_buf(int inum, struct fuse_bufvec *src, off_t offset, handle *hh) {
+    size_t size = fuse_buf_size(src);
+    if (size == 0) {
+        return 0;
+    }
+    inode_cursor cur;
+    if (hh != NULL) {
+        cur = handle_cursor(hh);
+    }
+
+    inode *fptr = get_inode(inum);
+    inode_wrlock(fptr);
+    int64_t oldSize = fptr->size;
+    int rv = -ENOSPC;
+    // every page first, so they come out of the allocator in runs. The
+    // extend zeroes whatever's left of the old last page before the copy
+    // can land there.
+    if (inode_allocate(fptr, offset, size) == 0 && extend_inode(fptr, offset + size) == 0) {
+        struct fuse_bufvec *dst = map_span(fptr, size, offset, 0, hh ? &cur : NULL);
+        rv = (dst == NULL) ? -EIO : fuse_buf_copy(dst, src, 0);
+        free(dst);
+        if (rv > 0 && inode_mark_written(fptr, offset, rv) < 0) {
+            rv = -ENOSPC;
+        }
+    }
+    // only as far as the copy got: a pipe can run dry, and a failed copy
+    // leaves the size where it was. Pages past that stay as they came from
+    // the allocator, zeroed.
+    int64_t end = (rv > 0) ? offset + rv : 0;
+    fptr->size = (end > oldSize) ? end : oldSize;
+    fptr->last_change = now();
+    inode_unlock(fptr);
+
+    if (hh != NULL) {
+        handle_set_cursor(hh, cur);
+    }
+    return rv;
+}
+
+// Reads the target into buf, NUL terminated.
+int ops_readlink(int inum, char *buf, size_t size) {
+    // reads stop at the end of the file, so terminate it ourselves
+    int rv = ops_read(inum, buf, size - 1, 0, NULL);
+    if (rv < 0) {
+        return rv;
+    }
+    buf[rv] = 0;
+    return 0;
+}
+
+// Straight from the free counters, so it costs the same on any image.
+void ops_statfs(struct statvfs *st) {
+    long pages, freePages, inodes, freeInodes;
+    pages_counts(&pages, &freePages);
+    inode_counts(&inodes, &freeInodes);
+    // deleted files' pages are as good as free: alloc_pages() takes them
+    // back before it grows the image
+    freePages += reclaim_pending();
+
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = PAGE_SIZE;
+    st->f_frsize = PAGE_SIZE;
+    st->f_blocks = pages;
+    st->f_bfree = freePages;
+    st->f_bavail = freePages;
+    st->f_files = inodes;
+    st->f_ffree = freeInodes;
+    st->f_favail = freeInodes;
+    st->f_namemax = DIR_NAME - 1;
+}
@@ -0,0 +1,86 @@
+// Filesystem operations keyed on inode numbers.
+//
+// Both FUSE front ends sit on top of these: nufs.c turns paths into inode
+// numbers first, nufs_ll.c gets them straight from the kernel. Everything
+// here takes the locks it needs and returns 0 or a negative errno.
+//
+// The calls that change names also take the whole path, so the dcache is
+// brought up to date while the directory is still locked. The low-level
+// front end has no paths and passes NULL.
+
+#ifndef OPS_H
+#define OPS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "handle.h"
+
+// how reads update atimes, from the noatime / relatime / strictatime
+// mount options
+#define ATIME_STRICT 0
+#define ATIME_RELATIME 1
+#define ATIME_NOATIME 2
+
+// the most we ask the kernel to send in one write; libfuse and the
+// kernel cut it down to what they can do (128K for the 2.x ABI)
+#define NUFS_MAX_WRITE (1 << 20)
+
+// lseek(SEEK_DATA / SEEK_HOLE) as ioctls, since the 2.x FUSE API doesn't
+// pass lseek on. The int64_t is the offset to start from going in and the
+// answer coming out.
+#define NUFS_IOC_SEEK_DATA _IOWR('N', 2, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR('N', 3, int64_t)
+
+struct fuse_bufvec;
+struct statvfs;
+
+void ops_stat(int inum, struct stat *st);
+
+int ops_create(int parent, const char *name, const char *path, mode_t mode, int *inum);
+
+int ops_symlink(int parent, const char *name, const char *path, const char *target,
+                int *inum);
+
+int ops_link(int inum, int parent, const char *name, const char *path);
+
+int ops_unlink(int parent, const char *name, const char *path, int *inum);
+
+int ops_rmdir(int parent, const char *name, const char *path, int *inum);
+
+void ops_evict(int inum);
+
+int ops_rename(int fromParent, const char *fromName, const char *fromPath,
+               int toParent, const char *toName, const char *toPath);
+
+int ops_truncate(int inum, off_t size);
+
+int ops_chmod(int inum, mode_t mode);
+
+int ops_utimens(int inum, const struct timespec ts[2]);
+
+void ops_touch(int inum);
+
+void ops_set_atime(int mode);
+
+int ops_read(int inum, char *buf, size_t size, off_t offset, handle *hh);
+
+int ops_write(int inum, const char *buf, size_t size, off_t offset, handle *hh);
+
+int ops_read_buf(int inum, size_t size, off_t offset, handle *hh,
+                 int (*reply)(void *arg, struct fuse_bufvec *bv), void *arg);
+
+int ops_write_buf(int inum, struct fuse_bufvec *src, off_t offset, handle *hh);
+
+int ops_fallocate(int inum, int mode, off_t offset, off_t length);
+
+off_t ops_seek(int inum, off_t offset, int whence);
+
+int ops_readlink(int inum, char *buf, size_t size);
+
+void ops_statfs(struct statvfs *st);
+
+#endif
@@ -7,95 +7,487 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <linux/falloc.h>
 
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
 #include "inode.h"
+#include "trace.h"
+#include "stats.h"
+#include "reclaim.h"
 
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE = 4096 * 256; // 1MB
+static const int PAGE_SIZE = 4096;
+static const int INITIAL_PAGE_COUNT = 256; // 1MB, grown on demand
+static const int MAX_PAGE_COUNT = 1 << 28; // 1TB of address space reserved
 
 static int pages_fd = -1;
 static void *pages_base = 0;
+static int alloc_hint = 1; // next-fit: where the last search left off
+static int punch_holes = 1; // until the host filesystem says it can't
+// Punching a hole is a syscall and some filesystem bookkeeping, which for
+// a few pages costs more than zeroing them. Shorter runs are zeroed and
+// keep their blocks until they're used again.
+static const int PUNCH_MIN = 16;
+
+// Covers the page bitmap, alloc_hint, and the page counts in the
+// superblock. Nothing else is locked while it's held.
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void free_pages_locked(int pnum, int count);
+
+static void release_pages(int pnum, int count);
+
+static int
+bitmap_pages_for(int bits) {
+    // bitmaps are scanned in whole longs, so round up to one
+    int longs = (bits + 63) / 64;
+    return bytes_to_pages(longs * sizeof(unsigned long));
+}
+
+// Maps [old_count, new_count) of the backing file into the reserved
+// region right after what is already mapped, so existing pointers into
+// the image stay valid.
+static void
+pages_map(int old_count, int new_count) {
+    int rv = ftruncate(pages_fd, (off_t) new_count * PAGE_SIZE);
+    assert(rv == 0);
+
+    void *at = pages_base + (size_t) old_count * PAGE_SIZE;
+    size_t len = (size_t) (new_count - old_count) * PAGE_SIZE;
+    void *got = mmap(at, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                     pages_fd, (off_t) old_count * PAGE_SIZE);
+    assert(got == at);
+}
+
+static void
+pages_format(int page_count) {
+    superblock *sb = pages_get_superblock();
+    sb->magic = NUFS_MAGIC;
+    sb->version = NUFS_VERSION;
+    sb->page_count = page_count;
+    sb->pbm_start = 1;
+    sb->pbm_pages = bitmap_pages_for(page_count);
+    sb->ibm_start = sb->pbm_start + sb->pbm_pages;
+    sb->ibm_pages = bitmap_pages_for(ITAB_FIRST_CHUNK);
+    sb->inode_count = ITAB_FIRST_CHUNK;
+    sb->free_inodes = ITAB_FIRST_CHUNK;
+    sb->itab_chunks = 1;
+    sb->itab[0] = sb->ibm_start + sb->ibm_pages;
+
+    // everything up to the end of the first inode table chunk is taken
+    void *pbm = get_pages_bitmap();
+    int used = sb->itab[0] + bytes_to_pages(ITAB_FIRST_CHUNK * sizeof(inode));
+    bitmap_put_range(pbm, 0, used, 1);
+    sb->free_pages = page_count - used;
+}
+
+// The free counts in the superblock are only as good as the last unmount.
+// Count the bitmaps again and fix them if a crash left them off.
+static void
+pages_recount() {
+    superblock *sb = pages_get_superblock();
+    int freePages = sb->page_count - bitmap_count(get_pages_bitmap(), 0, sb->page_count);
+    int freeInodes = sb->inode_count - bitmap_count(get_inode_bitmap(), 0, sb->inode_count);
+    if (freePages != sb->free_pages || freeInodes != sb->free_inodes) {
+        fprintf(stderr, "nufs: free counts were %d pages / %d inodes, now %d / %d\n",
+                sb->free_pages, sb->free_inodes, freePages, freeInodes);
+        sb->free_pages = freePages;
+        sb->free_inodes = freeInodes;
+    }
+}
+
+// Whether the first size bytes of the image file are all zeros, so that
+// formatting it can't lose anything. Holes are skipped over.
+static int
+file_is_zeros(off_t size) {
+    static const char zeros[4096];
+    char buf[4096];
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(pages_fd, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            return 1; // nothing but hole from here on
+        }
+        if (data > pos) {
+            pos = data;
+            continue;
+        }
+        ssize_t nn = pread(pages_fd, buf, sizeof(buf), pos);
+        if (nn <= 0) {
+            return nn == 0;
+        }
+        if (memcmp(buf, zeros, nn) != 0) {
+            return 0;
+        }
+        pos += nn;
+    }
+    return 1;
+}
 
 void
 pages_init(const char *path) {
     pages_fd = open(path, O_CREAT | O_RDWR, 0644);
     assert(pages_fd != -1);
 
-    int rv = ftruncate(pages_fd, NUFS_SIZE);
+    struct stat st;
+    int rv = fstat(pages_fd, &st);
     assert(rv == 0);
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    // Reserve address space for the largest image up front. The file is
+    // mapped over the start of it and grows into the rest.
+    pages_base = mmap(0, (size_t) MAX_PAGE_COUNT * PAGE_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     assert(pages_base != MAP_FAILED);
 
-    void *pbm = get_pages_bitmap();
-    if (bitmap_get(pbm, 0) == 1) {
-        //Bitmap + FileSystem already setup
+    superblock sb0;
+    memset(&sb0, 0, sizeof(sb0));
+    rv = pread(pages_fd, &sb0, sizeof(sb0), 0);
+    assert(rv >= 0);
+
+    // A new image, or one that's nothing but zeros. Anything else without
+    // the magic number could be someone's data under a wrong path or a
+    // damaged superblock, and isn't ours to format.
+    if (sb0.magic == 0 && (st.st_size == 0 || file_is_zeros(st.st_size))) {
+        // Zeros someone wrote out still take up space, so they go, and
+        // only what gets written from here on is stored.
+        int page_count = max(st.st_size / PAGE_SIZE, INITIAL_PAGE_COUNT);
+        pages_map(0, page_count);
+        if (st.st_size > 0) {
+            release_pages(0, st.st_size / PAGE_SIZE);
+        }
+        pages_format(page_count);
         return;
     }
 
-    bitmap_put(pbm, 0, 1);
-    //bitmap_print(pbm, 32);
-    //page 1 is inode array
-    bitmap_put(pbm, 1, 1);
-
-    //page 2 is more inode array
-    bitmap_put(pbm, 2, 1);
+    if (sb0.magic != NUFS_MAGIC || sb0.version != NUFS_VERSION) {
+        fprintf(stderr, "%s: not a nufs image (or an older layout)\n", path);
+        exit(1);
+    }
+    // the superblock is the authority on size, not the file
+    pages_map(0, sb0.page_count);
+    pages_recount();
 }
 
 void
 pages_free() {
-    int rv = munmap(pages_base, NUFS_SIZE);
+    int rv = munmap(pages_base, (size_t) MAX_PAGE_COUNT * PAGE_SIZE);
     assert(rv == 0);
+    close(pages_fd);
 }
 
 void *
 pages_get_page(int pnum) {
-    return pages_base + 4096 * pnum;
+    return pages_base + (size_t) PAGE_SIZE * pnum;
+}
+
+// The image file itself. The mapping is MAP_SHARED, so reading or writing
+// page pnum at pnum * 4096 through this sees the same bytes.
+int
+pages_get_fd() {
+    return pages_fd;
+}
+
+// Pages in the image and how many are free, counting the room the image
+// still has to grow as both: that much more can be written before ENOSPC.
+void
+pages_counts(long *total, long *free) {
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&alloc_lock);
+    *total = sb->page_count;
+    *free = sb->free_pages;
+    pthread_mutex_unlock(&alloc_lock);
+
+    struct statvfs host;
+    if (fstatvfs(pages_fd, &host) == 0) {
+        long room = host.f_bavail * host.f_frsize / PAGE_SIZE;
+        if (room > MAX_PAGE_COUNT - *total) {
+            room = MAX_PAGE_COUNT - *total;
+        }
+        *total += room;
+        *free += room;
+    }
+}
+
+superblock *
+pages_get_superblock() {
+    return (superblock *) pages_get_page(0);
+}
+
+// Grow the image to page_count pages while mounted. If the page bitmap no
+// longer fits it is moved into the start of the new space.
+// Returns 0 on success, -1 if the image is already as big as it can get.
+static int
+pages_grow_locked(int page_count) {
+    superblock *sb = pages_get_superblock();
+    int old_count = sb->page_count;
+    page_count = min(page_count, MAX_PAGE_COUNT);
+    if (page_count <= old_count) {
+        return -1;
+    }
+
+    pages_map(old_count, page_count);
+    TRACE(TR_PAGES, TR_INFO, "+ pages_grow(%d -> %d)", old_count, page_count);
+    sb->free_pages += page_count - old_count;
+
+    int need = bitmap_pages_for(page_count);
+    if (need > sb->pbm_pages) {
+        int old_start = sb->pbm_start;
+        int old_pages = sb->pbm_pages;
+        void *old_pbm = get_pages_bitmap();
+        void *new_pbm = pages_get_page(old_count);
+        memcpy(new_pbm, old_pbm, (size_t) old_pages * PAGE_SIZE);
+
+        sb->pbm_start = old_count;
+        sb->pbm_pages = need;
+        bitmap_put_range(new_pbm, old_count, need, 1);
+        sb->free_pages -= need;
+        sb->page_count = page_count;
+        release_pages(old_start, old_pages);
+        free_pages_locked(old_start, old_pages);
+    }
+    sb->page_count = page_count;
+    return 0;
+}
+
+int
+pages_grow(int page_count) {
+    pthread_mutex_lock(&alloc_lock);
+    int rv = pages_grow_locked(page_count);
+    pthread_mutex_unlock(&alloc_lock);
+    return rv;
 }
 
 void *
 get_pages_bitmap() {
-    return pages_get_page(0);
+    return pages_get_page(pages_get_superblock()->pbm_start);
 }
 
 void *
 get_inode_bitmap() {
-    uint8_t *page = pages_get_page(0);
-    return (void *) (page + 32);
+    return pages_get_page(pages_get_superblock()->ibm_start);
+}
+
+// Looks for count free pages in a row in [from, to). Returns the start of
+// the first such run, or -1 after recording the longest shorter run seen
+// in *best / *bestLen. Adds how many pages it went past to *scanned.
+static int
+find_run(void *pbm, int from, int to, int count, int *best, int *bestLen, int *scanned) {
+    int ii = from;
+    while ((ii = bitmap_next_zero(pbm, ii, to)) != -1) {
+        int stop = min(to, ii + count);
+        int end = bitmap_next_one(pbm, ii, stop);
+        if (end == -1) {
+            end = stop;
+        }
+        if (end - ii >= count) {
+            *scanned += ii - from;
+            return ii;
+        }
+        if (end - ii > *bestLen) {
+            *best = ii;
+            *bestLen = end - ii;
+        }
+        ii = end;
+    }
+    *scanned += to - from;
+    return -1;
+}
+
+// Marks [start, start + len) as in use.
+static void
+take_run(int start, int len) {
+    bitmap_put_range(get_pages_bitmap(), start, len, 1);
+    pages_get_superblock()->free_pages -= len;
+    alloc_hint = start + len;
 }
 
+// Allocate up to count physically contiguous pages, starting at goal if
+// that page is free (0 for no preference). Returns the first page of the
+// run and stores its length in *got, which is only short of count when
+// the free space is too fragmented for a full run.
 int
-alloc_page() {
+alloc_pages(int count, int goal, int *got) {
+    assert(count > 0);
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&alloc_lock);
+    while (sb->free_pages < count) {
+        // deleted files' pages come back in the background, and only when
+        // there's nothing else to do. Take them before the image grows.
+        pthread_mutex_unlock(&alloc_lock);
+        int more = reclaim_some();
+        pthread_mutex_lock(&alloc_lock);
+        if (!more) {
+            break;
+        }
+    }
+    if (sb->free_pages < count) {
+        // double the image, or more if that still wouldn't fit the request
+        int want = max(sb->page_count * 2, sb->page_count + 2 * count);
+        if (pages_grow_locked(want) != 0 && sb->free_pages == 0) {
+            pthread_mutex_unlock(&alloc_lock);
+            return -1;
+        }
+    }
+
     void *pbm = get_pages_bitmap();
-    for (int ii = 1; ii < PAGE_COUNT; ++ii) {
-        if (bitmap_get(pbm, ii) == 0) {
-            bitmap_put(pbm, ii, 1);
-            printf("+ alloc_page() -> %d\n", ii);
-            return ii;
+    int best = -1;
+    int bestLen = 0;
+    int start = -1;
+    int scanned = 0;
+    if (goal > 0 && goal < sb->page_count && bitmap_get(pbm, goal) == 0) {
+        // only the run starting right at goal is of interest here
+        int stop = min(sb->page_count, goal + count);
+        int end = bitmap_next_one(pbm, goal, stop);
+        if (end == -1) {
+            end = stop;
+        }
+        if (end - goal >= count) {
+            start = goal;
+        } else {
+            best = goal;
+            bestLen = end - goal;
         }
     }
+    if (start == -1) {
+        start = find_run(pbm, alloc_hint, sb->page_count, count, &best, &bestLen, &scanned);
+    }
+    if (start == -1) {
+        start = find_run(pbm, 1, alloc_hint, count, &best, &bestLen, &scanned);
+    }
 
-    return -1;
+    int len = count;
+    if (start == -1) {
+        start = best;
+        len = bestLen;
+    }
+    assert(start > 0);
+
+    take_run(start, len);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_pages_alloc(len, scanned);
+    *got = len;
+    TRACE(TR_PAGES, TR_DEBUG, "+ alloc_pages(%d) -> %d (+%d)", count, start, len);
+    return start;
+}
+
+// Allocate exactly count contiguous pages, growing the image if no free
+// run is that long. Returns the first page, or -1.
+int
+alloc_contiguous(int count) {
+    assert(count > 0);
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&alloc_lock);
+    int start = bitmap_next_zeros(get_pages_bitmap(), 1, sb->page_count, count);
+    int scanned = (start == -1) ? sb->page_count - 1 : start - 1;
+    if (start == -1) {
+        // the new space is one free run, less a moved bitmap at its start
+        int old_count = sb->page_count;
+        if (pages_grow_locked(max(old_count * 2, old_count + 2 * count)) == 0) {
+            start = bitmap_next_zeros(get_pages_bitmap(), old_count, sb->page_count, count);
+        }
+        if (start == -1) {
+            pthread_mutex_unlock(&alloc_lock);
+            return -1;
+        }
+    }
+
+    take_run(start, count);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_pages_alloc(count, scanned);
+    TRACE(TR_PAGES, TR_DEBUG, "+ alloc_contiguous(%d) -> %d", count, start);
+    return start;
+}
+
+int
+alloc_page() {
+    int got;
+    return alloc_pages(1, 0, &got);
+}
+
+// Zero count pages from pnum. For long enough runs, where the host
+// filesystem can punch holes, their blocks go back to it too, so freed
+// pages take no space in the image file, and the mapping reads zeros
+// there from then on. The pages must not be in the bitmap as free yet, or
+// they could be handed out and written before this gets to them.
+static void
+release_pages(int pnum, int count) {
+    if (count >= PUNCH_MIN && __atomic_load_n(&punch_holes, __ATOMIC_RELAXED)) {
+        int rv = fallocate(pages_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           (off_t) pnum * PAGE_SIZE, (off_t) count * PAGE_SIZE);
+        if (rv == 0) {
+            return;
+        }
+        if (errno == EOPNOTSUPP || errno == ENOSYS) {
+            __atomic_store_n(&punch_holes, 0, __ATOMIC_RELAXED);
+        }
+    }
+    memset(pages_get_page(pnum), 0, (size_t) count * PAGE_SIZE);
+}
+
+static void
+free_pages_locked(int pnum, int count) {
+    assert(pnum > 0 && pnum + count <= pages_get_superblock()->page_count);
+    void *pbm = get_pages_bitmap();
+    assert(bitmap_count(pbm, pnum, pnum + count) == count);
+    bitmap_put_range(pbm, pnum, count, 0);
+    pages_get_superblock()->free_pages += count;
+}
+
+// Free count pages starting at pnum, all of which have to be in use. The
+// zeroing happens before the lock, since it's the slow part and nobody
+// else can have these pages yet.
+void
+free_pages(int pnum, int count) {
+    TRACE(TR_PAGES, TR_DEBUG, "+ free_pages(%d, %d)", pnum, count);
+    release_pages(pnum, count);
+    pthread_mutex_lock(&alloc_lock);
+    free_pages_locked(pnum, count);
+    pthread_mutex_unlock(&alloc_lock);
+    stats_pages_free(count);
 }
 
 void
 free_page(int pnum) {
-    printf("+ free_page(%d)\n", pnum);
-    void *page1 = pages_get_page(pnum);
-    size_t PAGE_SIZE = 4096;
-    memset(page1, 0, PAGE_SIZE);
+    free_pages(pnum, 1);
+}
 
-    void *pbm = get_pages_bitmap();
-    bitmap_put(pbm, pnum, 0);
+// Add [pnum, pnum + count) to the pages pb is collecting. Runs that carry
+// straight on from the last one join it, so freeing a file whose extents
+// sit end to end in the image is one hole punched rather than one per
+// extent. Anything else frees what's collected first.
+void
+free_batch_add(page_batch *pb, int pnum, int count) {
+    if (pb->count > 0 && pnum == pb->start + pb->count) {
+        pb->count += count;
+        return;
+    }
+    if (pb->count > 0 && pnum + count == pb->start) {
+        // truncating goes from the end of the file back
+        pb->start = pnum;
+        pb->count += count;
+        return;
+    }
+    free_batch_flush(pb);
+    pb->start = pnum;
+    pb->count = count;
 }
 
+// Free whatever pb has collected.
+void
+free_batch_flush(page_batch *pb) {
+    if (pb->count > 0) {
+        free_pages(pb->start, pb->count);
+        pb->count = 0;
+    }
+}
@@ -4,6 +4,31 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
+
+#define NUFS_MAGIC 0x5346554e // "NUFS"
+#define NUFS_VERSION 10
+
+#define ITAB_FIRST_CHUNK 256
+#define ITAB_MAX_CHUNKS 20
+
+// Page 0 of the image. Describes where everything else lives so the
+// image can grow without the layout being baked into the code.
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    int page_count; // pages currently in the image
+    int pbm_start;  // page bitmap: first page and length in pages
+    int pbm_pages;
+    int ibm_start;  // inode bitmap
+    int ibm_pages;
+    int free_pages; // kept up to date by alloc_page() / free_page()
+    int inode_count; // inodes the table has room for
+    int free_inodes; // kept up to date by alloc_inode() / free_inode()
+    int itab_chunks; // inode table: chunk k starts at page itab[k] and
+    int itab[ITAB_MAX_CHUNKS]; // holds ITAB_FIRST_CHUNK << k inodes
+    int orphan_head; // first inode waiting to be freed, 0 for none
+} superblock;
 
 void pages_init(const char *path);
 
@@ -11,12 +36,37 @@ void pages_free();
 
 void *pages_get_page(int pnum);
 
+int pages_get_fd();
+
+superblock *pages_get_superblock();
+
+void pages_counts(long *total, long *free);
+
+int pages_grow(int page_count);
+
 void *get_pages_bitmap();
 
 void *get_inode_bitmap();
 
 int alloc_page();
 
+int alloc_pages(int count, int goal, int *got);
+
+int alloc_contiguous(int count);
+
 void free_page(int pnum);
 
+void free_pages(int pnum, int count);
+
+// Pages on their way to free_pages(), collected so that neighbouring runs
+// are freed together. Zeroed means empty.
+typedef struct page_batch {
+    int start;
+    int count;
+} page_batch;
+
+void free_batch_add(page_batch *pb, int pnum, int count);
+
+void free_batch_flush(page_batch *pb);
+
 #endif
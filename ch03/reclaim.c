@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+#include "reclaim.h"
+#include "pages.h"
+#include "inode.h"
+#include "extent.h"
+#include "util.h"
+#include "trace.h"
+
+// Covers orphan_head in the superblock and the orphans' next_orphan.
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t orphan_cond = PTHREAD_COND_INITIALIZER;
+
+// Orphans something still has open (the low-level front end's unlinked
+// files the kernel hasn't forgotten). They're on the list so a crash
+// can't leak them, but nothing frees them until they're released. Only ever a few, and only in memory: after a restart nothing
+// has them any more. Under orphan_lock too.
+static int *held = NULL;
+static int heldCount = 0;
+static int heldCap = 0;
+
+static pthread_t reclaim_thread;
+static int running = 0;
+static int stopping = 0;
+
+static void reclaim_inode(int inum, int onList);
+
+// Hand inum over to be freed. Nothing can reach it any more, so it's ours.
+// When the thread isn't running (not started yet, stopped, or it wouldn't
+// start) the caller frees it right here.
+void reclaim_push(int inum) {
+    if (!running) {
+        reclaim_inode(inum, 0);
+        return;
+    }
+
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&orphan_lock);
+    get_inode(inum)->next_orphan = sb->orphan_head;
+    sb->orphan_head = inum;
+    pthread_cond_signal(&orphan_cond);
+    pthread_mutex_unlock(&orphan_lock);
+    TRACE(TR_INODE, TR_DEBUG, "+ reclaim_push(%d)", inum);
+}
+
+static int held_find(int inum) {
+    for (int ii = 0; ii < heldCount; ++ii) {
+        if (held[ii] == inum) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static void held_drop(int inum) {
+    int ii = held_find(inum);
+    if (ii >= 0) {
+        held[ii] = held[--heldCount];
+    }
+}
+
+// inum has no names left but someone still has it. It goes on the list
+// now and is freed after reclaim_release().
+void reclaim_hold(int inum) {
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&orphan_lock);
+    if (heldCount == heldCap) {
+        heldCap = heldCap ? heldCap * 2 : 16;
+        held = realloc(held, heldCap * sizeof(int));
+    }
+    held[heldCount++] = inum;
+    get_inode(inum)->next_orphan = sb->orphan_head;
+    sb->orphan_head = inum;
+    pthread_mutex_unlock(&orphan_lock);
+    TRACE(TR_INODE, TR_DEBUG, "+ reclaim_hold(%d)", inum);
+}
+
+// The last user of a held orphan is done with it.
+void reclaim_release(int inum) {
+    if (!running) {
+        // still held while we free it, so reclaim_some() keeps off it
+        reclaim_inode(inum, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&orphan_lock);
+    assert(held_find(inum) >= 0);
+    held_drop(inum);
+    pthread_cond_signal(&orphan_cond);
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+// The first orphan on the list that nobody's holding, write locked, or 0.
+// The caller has orphan_lock. Only ever trying the inode's lock means
+// this is safe from under another inode's lock (alloc_pages() is called
+// with the file being written locked), and the lock is what keeps two
+// reclaimers off the same orphan. *busy is set if one was skipped
+// because its lock was taken.
+static int lock_next_orphan(superblock *sb, int *busy) {
+    *busy = 0;
+    for (int inum = sb->orphan_head; inum != 0; inum = get_inode(inum)->next_orphan) {
+        if (held_find(inum) >= 0) {
+            continue;
+        }
+        if (inode_trywrlock(get_inode(inum)) == 0) {
+            return inum;
+        }
+        *busy = 1;
+    }
+    return 0;
+}
+
+// Take inum off the list, wherever it is. New orphans go on the front, so
+// it's never far from there. The caller has orphan_lock.
+static void orphan_unlink(int inum) {
+    superblock *sb = pages_get_superblock();
+    int next = get_inode(inum)->next_orphan;
+    if (sb->orphan_head == inum) {
+        sb->orphan_head = next;
+    } else {
+        inode *prev = get_inode(sb->orphan_head);
+        while (prev->next_orphan != inum) {
+            assert(prev->next_orphan != 0);
+            prev = get_inode(prev->next_orphan);
+        }
+        prev->next_orphan = next;
+    }
+}
+
+// Free up to RECLAIM_BATCH of the write locked inode's pages, off the end.
+// Returns 1 if there are none left.
+static int reclaim_batch(inode *node) {
+    int end = (node->flags & INODE_IS_INLINE) ? 0 : extent_end(node);
+    int64_t keep = (int64_t) max(0, end - RECLAIM_BATCH) * 4096;
+    // fallocate'd pages can be past the size, and shrink_inode() won't
+    // shrink anything to a bigger size
+    if (node->size < keep) {
+        node->size = keep;
+    }
+    shrink_inode(node, keep);
+    return keep == 0;
+}
+
+// One batch off inum, which the caller has write locked, and unlock it.
+// Once it's empty it comes off the list before the lock goes, so nobody
+// can pick it up again, and is freed. Returns 1 if it's gone.
+static int reclaim_step(int inum, int onList) {
+    inode *node = get_inode(inum);
+    int done = reclaim_batch(node);
+    if (onList) {
+        pthread_mutex_lock(&orphan_lock);
+        if (done) {
+            orphan_unlink(inum);
+            held_drop(inum);
+        }
+        // anyone in reclaim_some() waiting for this one can go on
+        pthread_cond_broadcast(&orphan_cond);
+        pthread_mutex_unlock(&orphan_lock);
+    }
+    inode_unlock(node);
+    if (done) {
+        free_inode(inum);
+        TRACE(TR_INODE, TR_DEBUG, "+ reclaim_inode(%d) done", inum);
+    }
+    return done;
+}
+
+// Free the inode and its pages, right here. One that's on the list has to
+// be held so nothing else works on it at the same time.
+static void reclaim_inode(int inum, int onList) {
+    inode *node = get_inode(inum);
+    do {
+        inode_wrlock(node);
+    } while (!reclaim_step(inum, onList));
+}
+
+// Free a batch of some orphan's pages, for alloc_pages() to use instead of
+// growing the image. The thread runs at SCHED_IDLE, so on a busy mount it
+// can fall well behind. If every orphan is locked, that's most likely the
+// thread part way through a batch, so this waits a little for it. Returns
+// 1 if some pages may have been freed, 0 if there's nothing to do.
+int reclaim_some() {
+    superblock *sb = pages_get_superblock();
+    int busy;
+    pthread_mutex_lock(&orphan_lock);
+    int inum = lock_next_orphan(sb, &busy);
+    if (inum == 0 && busy) {
+        // the lock could also be one we have: a stripe shared with the
+        // caller's file. So don't wait long.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 5 * 1000 * 1000;
+        if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000 * 1000 * 1000;
+        }
+        int rv = pthread_cond_timedwait(&orphan_cond, &orphan_lock, &ts);
+        pthread_mutex_unlock(&orphan_lock);
+        return rv == 0;
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    if (inum == 0) {
+        return 0;
+    }
+    reclaim_step(inum, 1);
+    return 1;
+}
+
+// Pages on the list waiting to be freed, for statfs. Held orphans are
+// still in use, so they don't count.
+long reclaim_pending() {
+    superblock *sb = pages_get_superblock();
+    long pages = 0;
+    pthread_mutex_lock(&orphan_lock);
+    for (int inum = sb->orphan_head; inum != 0; inum = get_inode(inum)->next_orphan) {
+        if (held_find(inum) < 0) {
+            pages += __atomic_load_n(&get_inode(inum)->pages, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    return pages;
+}
+
+static void *reclaim_main(void *arg) {
+    // requests come first: at a normal priority, being woken by an unlink
+    // would take the CPU from the thread that's meant to be replying. Idle
+    // threads still get a little time when everything else is busy, and
+    // alloc_pages() does its own when it's short.
+    struct sched_param sp = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+
+    superblock *sb = pages_get_superblock();
+    pthread_mutex_lock(&orphan_lock);
+    while (!stopping) {
+        int busy;
+        int inum = lock_next_orphan(sb, &busy);
+        if (inum == 0) {
+            if (busy) {
+                // someone else has it, or a live file on the same stripe
+                // does; either way it's let go of soon
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec++;
+                pthread_cond_timedwait(&orphan_cond, &orphan_lock, &ts);
+            } else {
+                pthread_cond_wait(&orphan_cond, &orphan_lock);
+            }
+            continue;
+        }
+        pthread_mutex_unlock(&orphan_lock);
+        reclaim_step(inum, 1);
+        pthread_mutex_lock(&orphan_lock);
+    }
+    pthread_mutex_unlock(&orphan_lock);
+    return NULL;
+}
+// Starts the reclaimer, which begins with whatever the last mount left on
+// the list. Called once FUSE is done forking.
+void reclaim_start() {
+    if (!running) {
+        stopping = 0;
+        running = (pthread_create(&reclaim_thread, NULL, reclaim_main, NULL) == 0);
+    }
+}
+
+// Stops the reclaimer. Anything it didn't get to, or that's still held,
+// stays on the list.
+void reclaim_stop() {
+    if (!running) {
+        return;
+    }
+    pthread_mutex_lock(&orphan_lock);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&orphan_cond);
+    pthread_mutex_unlock(&orphan_lock);
+    pthread_join(reclaim_thread, NULL);
+    running = 0;
+}
@@ -0,0 +1,39 @@
+// Freeing inodes in the background.
+//
+// Once an inode has no names and nobody has it open, ops_evict() puts it
+// on the orphan list and returns. The list starts at orphan_head in the
+// superblock and goes on through each inode's next_orphan. A reclaimer
+// thread frees the pages a batch at a time, from the end of the file
+// back, and only then takes the inode off the list and frees it. The list
+// is in the image, so whatever an unmount or a crash leaves on it is
+// finished off after the next mount.
+//
+// An inode that loses its last name while something still has it (the
+// kernel, in the low-level front end) goes on the list right away with
+// reclaim_hold(), so a crash can't leak it, and is only freed after
+// reclaim_release().
+
+#ifndef RECLAIM_H
+#define RECLAIM_H
+
+// pages freed per trip through the inode's lock
+#define RECLAIM_BATCH 1024
+
+void reclaim_push(int inum);
+
+void reclaim_hold(int inum);
+
+void reclaim_release(int inum);
+
+// Free a batch of orphaned pages now, in the caller's thread. Returns 0 if
+// there was nothing to free.
+int reclaim_some();
+
+// Orphaned pages not freed yet.
+long reclaim_pending();
+
+void reclaim_start();
+
+void reclaim_stop();
+
+#endif
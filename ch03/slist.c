@@ -15,18 +15,18 @@ s_cons(const char *text, slist *rest) {
     return xs;
 }
 
+// iterative, since a big directory listing can be very long
 void
 s_free(slist *xs) {
-    if (xs == 0) {
-        return;
-    }
-
-    xs->refs -= 1;
-
-    if (xs->refs == 0) {
-        s_free(xs->next);
+    while (xs != 0) {
+        xs->refs -= 1;
+        if (xs->refs != 0) {
+            return;
+        }
+        slist *next = xs->next;
         free(xs->data);
         free(xs);
+        xs = next;
     }
 }
 
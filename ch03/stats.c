@@ -0,0 +1,164 @@
+// Counters and latency histograms. Everything is a relaxed atomic add, so
+// keeping them costs a couple of clock reads per operation and no locks.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+// bucket k counts values in [2^(k-1), 2^k), bucket 0 counts zeros
+#define STATS_BUCKETS 40
+
+typedef struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_BUCKETS];
+} stats_hist;
+
+typedef struct stats_opstat {
+    uint64_t errors;
+    stats_hist ns;
+} stats_opstat;
+
+static stats_opstat ops[OP_COUNT];
+static uint64_t pages_allocated;
+static uint64_t pages_freed;
+static stats_hist alloc_scans; // bitmap bits looked at per allocation
+static stats_hist dir_probes; // entries looked at per name lookup
+
+static const char *op_names[OP_COUNT] = {
+        [OP_ACCESS] = "access",
+        [OP_GETATTR] = "getattr",
+        [OP_SETATTR] = "setattr",
+        [OP_LOOKUP] = "lookup",
+        [OP_FORGET] = "forget",
+        [OP_OPENDIR] = "opendir",
+        [OP_READDIR] = "readdir",
+        [OP_RELEASEDIR] = "releasedir",
+        [OP_MKNOD] = "mknod",
+        [OP_MKDIR] = "mkdir",
+        [OP_LINK] = "link",
+        [OP_UNLINK] = "unlink",
+        [OP_RMDIR] = "rmdir",
+        [OP_RENAME] = "rename",
+        [OP_CHMOD] = "chmod",
+        [OP_TRUNCATE] = "truncate",
+        [OP_OPEN] = "open",
+        [OP_FLUSH] = "flush",
+        [OP_RELEASE] = "release",
+        [OP_READ] = "read",
+        [OP_WRITE] = "write",
+        [OP_UTIMENS] = "utimens",
+        [OP_IOCTL] = "ioctl",
+        [OP_SYMLINK] = "symlink",
+        [OP_READLINK] = "readlink",
+        [OP_STATFS] = "statfs",
+        [OP_FALLOCATE] = "fallocate",
+};
+
+static void add(uint64_t *counter, uint64_t nn) {
+    __atomic_add_fetch(counter, nn, __ATOMIC_RELAXED);
+}
+
+static uint64_t get(uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void hist_add(stats_hist *hh, uint64_t value) {
+    int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= STATS_BUCKETS) {
+        bucket = STATS_BUCKETS - 1;
+    }
+    add(&hh->count, 1);
+    add(&hh->sum, value);
+    add(&hh->buckets[bucket], 1);
+}
+
+uint64_t stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Count one call of op that began at start and returned rv.
+void stats_op(int op, uint64_t start, int rv) {
+    hist_add(&ops[op].ns, stats_now() - start);
+    if (rv < 0) {
+        add(&ops[op].errors, 1);
+    }
+}
+
+void stats_pages_alloc(int pages, int scanned) {
+    add(&pages_allocated, pages);
+    hist_add(&alloc_scans, scanned);
+}
+
+void stats_pages_free(int pages) {
+    add(&pages_freed, pages);
+}
+
+void stats_dir_probe(int scanned) {
+    hist_add(&dir_probes, scanned);
+}
+
+// Appends "name count=.. sum=.. hist=.." for hh, the histogram cut off
+// after the last bucket that has anything in it.
+static size_t render_hist(char *buf, size_t size, const char *name, const char *sumName,
+                          stats_hist *hh) {
+    size_t nn = snprintf(buf, size, "%s count=%lu %s=%lu hist=",
+                         name, get(&hh->count), sumName, get(&hh->sum));
+    int last = 0;
+    for (int ii = 0; ii < STATS_BUCKETS; ++ii) {
+        if (get(&hh->buckets[ii]) != 0) {
+            last = ii;
+        }
+    }
+    for (int ii = 0; ii <= last && nn < size; ++ii) {
+        nn += snprintf(buf + nn, size - nn, ii ? ",%lu" : "%lu", get(&hh->buckets[ii]));
+    }
+    return nn;
+}
+
+// Writes the stats out as text, one line per thing counted, and returns
+// how long that came to (even if it didn't all fit).
+size_t stats_render(char *buf, size_t size) {
+    char line[2048];
+    size_t nn = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        size_t len = render_hist(line, sizeof(line), op_names[op], "ns", &ops[op].ns);
+        len += snprintf(line + len, sizeof(line) - len, " errors=%lu\n", get(&ops[op].errors));
+        if (nn + len < size) {
+            memcpy(buf + nn, line, len);
+        }
+        nn += len;
+    }
+
+    size_t len = snprintf(line, sizeof(line), "pages allocated=%lu freed=%lu\n",
+                          get(&pages_allocated), get(&pages_freed));
+    len += render_hist(line + len, sizeof(line) - len, "alloc_scan", "bits", &alloc_scans);
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    len += render_hist(line + len, sizeof(line) - len, "dir_probe", "entries", &dir_probes);
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+    if (nn + len < size) {
+        memcpy(buf + nn, line, len);
+    }
+    nn += len;
+    return nn;
+}
+
+static void zero(void *counters, size_t bytes) {
+    uint64_t *cc = counters;
+    for (size_t ii = 0; ii < bytes / sizeof(uint64_t); ++ii) {
+        __atomic_store_n(&cc[ii], 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts that race with this may survive it; they're only counts.
+void stats_reset() {
+    zero(ops, sizeof(ops));
+    zero(&pages_allocated, sizeof(pages_allocated));
+    zero(&pages_freed, sizeof(pages_freed));
+    zero(&alloc_scans, sizeof(alloc_scans));
+    zero(&dir_probes, sizeof(dir_probes));
+}
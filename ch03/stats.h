@@ -0,0 +1,63 @@
+// Counters and latency histograms, readable at /.nufs/stats.
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+// ioctl on /.nufs/stats that zeroes everything
+#define NUFS_IOC_STATS_RESET _IO('N', 1)
+
+#define STATS_DIR "/.nufs"
+#define STATS_PATH "/.nufs/stats"
+
+// one per callback, in either front end
+enum stats_op {
+    OP_ACCESS,
+    OP_GETATTR,
+    OP_SETATTR,
+    OP_LOOKUP,
+    OP_FORGET,
+    OP_OPENDIR,
+    OP_READDIR,
+    OP_RELEASEDIR,
+    OP_MKNOD,
+    OP_MKDIR,
+    OP_LINK,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_RENAME,
+    OP_CHMOD,
+    OP_TRUNCATE,
+    OP_OPEN,
+    OP_FLUSH,
+    OP_RELEASE,
+    OP_READ,
+    OP_WRITE,
+    OP_UTIMENS,
+    OP_IOCTL,
+    OP_SYMLINK,
+    OP_READLINK,
+    OP_STATFS,
+    OP_FALLOCATE,
+    OP_COUNT
+};
+
+// Where an operation started, for stats_op().
+uint64_t stats_now();
+
+void stats_op(int op, uint64_t start, int rv);
+
+void stats_pages_alloc(int pages, int scanned);
+
+void stats_pages_free(int pages);
+
+void stats_dir_probe(int scanned);
+
+size_t stats_render(char *buf, size_t size);
+
+void stats_reset();
+
+#endif
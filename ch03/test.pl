@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 38;
 use IO::Handle;
 
 sub mount {
@@ -41,6 +41,50 @@ sub read_text_slice {
     return $data;
 }
 
+# the whole file, nothing stripped
+sub read_bytes {
+    my ($name) = @_;
+    open my $fh, "<:raw", "mnt/$name" or return "";
+    local $/ = undef;
+    my $data = <$fh> // "";
+    close $fh;
+    return $data;
+}
+
+sub write_at {
+    my ($name, $offset, $data) = @_;
+    open my $fh, "+<:raw", "mnt/$name" or return;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh;
+}
+
+sub size_of {
+    my ($name) = @_;
+    return (stat "mnt/$name")[7] // -1;
+}
+
+# in 512 byte units, like du
+sub blocks_of {
+    my ($name) = @_;
+    return (stat "mnt/$name")[12] // -1;
+}
+
+# _IOWR('N', 2 or 3, int64_t), from ops.h
+use constant NUFS_IOC_SEEK_DATA => 0xC0084E02;
+use constant NUFS_IOC_SEEK_HOLE => 0xC0084E03;
+
+# lseek(SEEK_DATA / SEEK_HOLE) the way nufs does it, since FUSE 2.x
+# doesn't pass lseek on. -1 if it failed.
+sub seek_ioctl {
+    my ($name, $cmd, $offset) = @_;
+    open my $fh, "<", "mnt/$name" or return -1;
+    my $buf = pack("q", $offset);
+    my $rv = ioctl($fh, $cmd, $buf);
+    close $fh;
+    return defined($rv) ? unpack("q", $buf) : -1;
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -187,4 +231,42 @@ mount();
 my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
+say "#           == Preallocation ==";
+
+# KEEP_SIZE gets the pages without making the file any longer
+system("touch mnt/keep.bin && fallocate -n -l 1M mnt/keep.bin");
+ok(size_of("keep.bin") == 0 && blocks_of("keep.bin") >= 2048, "fallocate KEEP_SIZE reserves space");
+
+system("truncate -s 1M mnt/keep.bin");
+ok(read_bytes("keep.bin") eq "\0" x (1 << 20), "preallocated pages read back as zeros");
+
+# only the bytes written stop being zeros, even in the same page
+system("fallocate -l 16384 mnt/unw.bin");
+write_at("unw.bin", 5000, "partial");
+my $unw = read_bytes("unw.bin");
+ok(length($unw) == 16384 && $unw eq ("\0" x 5000) . "partial" . ("\0" x (16384 - 5007)),
+   "partial write into unwritten pages");
+
+say "#           == Sparse Files ==";
+
+system("truncate -s 10M mnt/sparse.bin");
+ok(size_of("sparse.bin") == 10 << 20 && blocks_of("sparse.bin") == 0, "truncate up leaves a hole");
+ok(read_text_slice("sparse.bin", 16, 5 << 20) eq "\0" x 16, "hole reads as zeros");
+
+write_at("sparse.bin", 4 << 20, "data");
+ok(blocks_of("sparse.bin") == 8, "a write into the hole takes one page");
+ok(seek_ioctl("sparse.bin", NUFS_IOC_SEEK_DATA, 0) == 4 << 20, "SEEK_DATA finds the written page");
+ok(seek_ioctl("sparse.bin", NUFS_IOC_SEEK_HOLE, 4 << 20) == (4 << 20) + 4096
+   && seek_ioctl("sparse.bin", NUFS_IOC_SEEK_DATA, (4 << 20) + 4096) == -1,
+   "SEEK_HOLE finds its end, with no data after it");
+
+# fallocate'd pages nobody wrote are holes too
+ok(seek_ioctl("unw.bin", NUFS_IOC_SEEK_DATA, 0) == 4096 && seek_ioctl("unw.bin", NUFS_IOC_SEEK_HOLE, 4096) == 8192,
+   "unwritten pages count as holes");
+
+# a file that gets small enough goes back into its inode
+write_text("shrink.txt", "x" x 10000);
+system("truncate -s 20 mnt/shrink.txt");
+ok(blocks_of("shrink.txt") == 0 && read_text("shrink.txt") eq "x" x 20, "shrinking back to inline");
+
 unmount();
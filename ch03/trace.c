@@ -0,0 +1,328 @@
+// Tracing: per-thread ring buffers of unformatted records, and the thread
+// that drains them into the trace file.
+
+#ifdef NUFS_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define TRACE_ARGS 6
+#define TRACE_STR 60
+#define TRACE_RING 1024 // records per thread, a power of two
+
+// One TRACE() call. The format is a string literal, so keeping the
+// pointer is enough; everything else is copied.
+typedef struct trace_rec {
+    uint64_t ns;
+    const char *fmt;
+    int64_t args[TRACE_ARGS]; // numbers in the order they appear, as bits
+    uint8_t cat;
+    uint8_t level;
+    char str[TRACE_STR + 2]; // the %s arguments one after another, cut short
+} trace_rec;
+
+_Static_assert(sizeof(trace_rec) == 128, "trace records are 128 bytes");
+
+// Written by one thread, read by the drain thread. head and tail only
+// ever go up, and each side only writes its own.
+typedef struct trace_ring {
+    trace_rec recs[TRACE_RING];
+    unsigned head; // next record the owner writes
+    unsigned tail; // next record the drain thread reads
+    unsigned dropped; // records that didn't fit since the last drain
+    int tid;
+    int dead; // the thread is gone, free the ring once it's empty
+    struct trace_ring *next;
+} trace_ring;
+
+static __thread trace_ring *my_ring;
+static trace_ring *rings; // every thread's, under rings_lock
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t rings_key;
+static pthread_once_t rings_once = PTHREAD_ONCE_INIT;
+
+static FILE *trace_file;
+static pthread_t drain_thread;
+static int draining = 0;
+static int stopping = 0;
+
+static void ring_dead(void *arg) {
+    trace_ring *ring = arg;
+    __atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void rings_setup() {
+    pthread_key_create(&rings_key, ring_dead);
+}
+
+static trace_ring *get_ring() {
+    if (my_ring == NULL) {
+        pthread_once(&rings_once, rings_setup);
+        trace_ring *ring = calloc(1, sizeof(trace_ring));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->tid = syscall(SYS_gettid);
+
+        pthread_mutex_lock(&rings_lock);
+        ring->next = rings;
+        rings = ring;
+        pthread_mutex_unlock(&rings_lock);
+        pthread_setspecific(rings_key, ring);
+        my_ring = ring;
+    }
+    return my_ring;
+}
+
+// Skips the flags, width, precision and length of the conversion at fmt
+// (just past the %), setting *longish if it takes a long. Returns where
+// the conversion character is.
+static const char *conversion(const char *fmt, int *longish) {
+    while (*fmt && strchr("-+ #0123456789.", *fmt)) {
+        fmt++;
+    }
+    *longish = 0;
+    while (*fmt && strchr("hlLqjzt", *fmt)) {
+        if (strchr("lLqjzt", *fmt)) {
+            *longish = 1;
+        }
+        fmt++;
+    }
+    return fmt;
+}
+
+void trace_emit(int cat, int level, const char *fmt, ...) {
+    trace_ring *ring = get_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    unsigned head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING) {
+        // never wait for the drain thread
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    trace_rec *rec = &ring->recs[head % TRACE_RING];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    rec->fmt = fmt;
+    rec->cat = cat;
+    rec->level = level;
+
+    // pick the arguments up the way printf would, without formatting them
+    va_list ap;
+    va_start(ap, fmt);
+    int nargs = 0;
+    size_t nstr = 0;
+    for (const char *pp = fmt; *pp; ++pp) {
+        if (*pp != '%') {
+            continue;
+        }
+        int longish;
+        pp = conversion(pp + 1, &longish);
+        if (*pp == 0) {
+            break;
+        }
+        if (*pp == '%') {
+            continue;
+        }
+        if (*pp == 's') {
+            const char *ss = va_arg(ap, const char *);
+            size_t len = strnlen(ss ? ss : "(null)", TRACE_STR - nstr);
+            memcpy(rec->str + nstr, ss ? ss : "(null)", len);
+            rec->str[nstr + len] = 0;
+            nstr += len + 1;
+            if (nstr > TRACE_STR) {
+                nstr = TRACE_STR;
+            }
+            continue;
+        }
+        if (nargs == TRACE_ARGS) {
+            break;
+        }
+        if (strchr("fgeaFGEA", *pp)) {
+            double dd = va_arg(ap, double);
+            memcpy(&rec->args[nargs++], &dd, sizeof(dd));
+        } else if (*pp == 'p') {
+            rec->args[nargs++] = (intptr_t) va_arg(ap, void *);
+        } else if (longish) {
+            rec->args[nargs++] = va_arg(ap, long);
+        } else if (strchr("uxXo", *pp)) {
+            rec->args[nargs++] = va_arg(ap, unsigned);
+        } else {
+            rec->args[nargs++] = va_arg(ap, int);
+        }
+    }
+    va_end(ap);
+    rec->str[nstr] = 0;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static const char *cat_name(int cat) {
+    switch (cat) {
+        case TR_OPS:
+            return "ops";
+        case TR_DIR:
+            return "dir";
+        case TR_INODE:
+            return "inode";
+        case TR_PAGES:
+            return "pages";
+        case TR_DATA:
+            return "data";
+        default:
+            return "?";
+    }
+}
+
+// Formats one record into the trace file, one conversion at a time.
+static void render(trace_ring *ring, trace_rec *rec) {
+    static const char *levels[] = {"ERR", "INFO", "DEBUG"};
+    fprintf(trace_file, "%lu.%09lu %d %s %s: ", rec->ns / 1000000000, rec->ns % 1000000000,
+            ring->tid, cat_name(rec->cat), levels[rec->level]);
+
+    int nargs = 0;
+    const char *str = rec->str;
+    const char *pp = rec->fmt;
+    while (*pp) {
+        if (*pp != '%') {
+            fputc(*pp++, trace_file);
+            continue;
+        }
+        int longish;
+        const char *conv = conversion(pp + 1, &longish);
+        if (*conv == 0) {
+            break;
+        }
+        if (*conv == '%') {
+            fputc('%', trace_file);
+            pp = conv + 1;
+            continue;
+        }
+
+        // the same flags and width, always with a 64 bit argument
+        char spec[32];
+        const char *mods = pp;
+        while (mods < conv && !strchr("hlLqjzt", *mods)) {
+            mods++;
+        }
+        int len = snprintf(spec, sizeof(spec) - 4, "%.*s", (int) (mods - pp), pp);
+        if (*conv == 's') {
+            snprintf(spec + len, 4, "s");
+            fprintf(trace_file, spec, str);
+            str += strlen(str) + 1;
+            if (str > rec->str + TRACE_STR) {
+                str = rec->str + TRACE_STR;
+            }
+        } else if (nargs < TRACE_ARGS) {
+            int64_t arg = rec->args[nargs++];
+            if (strchr("fgeaFGEA", *conv)) {
+                double dd;
+                memcpy(&dd, &arg, sizeof(dd));
+                snprintf(spec + len, 4, "%c", *conv);
+                fprintf(trace_file, spec, dd);
+            } else if (*conv == 'p' || *conv == 'c') {
+                snprintf(spec + len, 4, "%c", *conv);
+                if (*conv == 'p') {
+                    fprintf(trace_file, spec, (void *) (intptr_t) arg);
+                } else {
+                    fprintf(trace_file, spec, (int) arg);
+                }
+            } else {
+                snprintf(spec + len, 4, "ll%c", *conv);
+                fprintf(trace_file, spec, (long long) arg);
+            }
+        }
+        pp = conv + 1;
+    }
+    fputc('\n', trace_file);
+}
+
+// Writes out everything the threads have put in their rings so far.
+static void drain() {
+    pthread_mutex_lock(&rings_lock);
+    trace_ring **pp = &rings;
+    while (*pp != NULL) {
+        trace_ring *ring = *pp;
+        int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+        unsigned tail = ring->tail;
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            render(ring, &ring->recs[tail % TRACE_RING]);
+            tail++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            fprintf(trace_file, "thread %d: %u records dropped\n", ring->tid, dropped);
+        }
+
+        if (dead) {
+            *pp = ring->next;
+            free(ring);
+        } else {
+            pp = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+    fflush(trace_file);
+}
+
+static void *drain_main(void *arg) {
+    struct timespec nap = {0, 10 * 1000 * 1000};
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        drain();
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+// Opens the trace file: path, or $NUFS_TRACE_FILE, or nufs.trace. Records
+// from before trace_start() wait in their rings.
+void trace_init(const char *path) {
+    if (path == NULL) {
+        path = getenv("NUFS_TRACE_FILE");
+    }
+    trace_file = fopen(path ? path : "nufs.trace", "w");
+    if (trace_file == NULL) {
+        perror("trace file");
+    }
+}
+
+// Starts the drain thread. Called once FUSE is done forking.
+void trace_start() {
+    if (trace_file != NULL && !draining) {
+        draining = (pthread_create(&drain_thread, NULL, drain_main, NULL) == 0);
+    }
+}
+
+// Stops the drain thread and writes out whatever is left.
+void trace_stop() {
+    if (trace_file == NULL) {
+        return;
+    }
+    if (draining) {
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        pthread_join(drain_thread, NULL);
+        draining = 0;
+    }
+    drain();
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+#endif
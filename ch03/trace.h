@@ -0,0 +1,67 @@
+// Tracing.
+//
+// TRACE(category, level, fmt, ...) takes printf-style arguments, but
+// nothing gets formatted where it's called. The record (the format, the
+// numbers, and copies of any strings) goes into a ring buffer belonging
+// to the calling thread, and a background thread turns them into text in
+// the trace file.
+//
+// Without -DNUFS_TRACE every TRACE() compiles to nothing, arguments
+// included. With it, NUFS_TRACE_LEVEL and NUFS_TRACE_CATS pick which ones
+// are kept, also at compile time.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+// levels
+#define TR_ERR 0
+#define TR_INFO 1  // one line per operation
+#define TR_DEBUG 2 // inside operations, can be many lines each
+
+// categories
+#define TR_OPS 0x01   // filesystem operations, as FUSE calls them
+#define TR_DIR 0x02   // directory contents
+#define TR_INODE 0x04 // inode table
+#define TR_PAGES 0x08 // page allocator
+#define TR_DATA 0x10  // file reads and writes, page by page
+#define TR_ALL 0xff
+
+#ifndef NUFS_TRACE_LEVEL
+#define NUFS_TRACE_LEVEL TR_INFO
+#endif
+
+#ifndef NUFS_TRACE_CATS
+#define NUFS_TRACE_CATS TR_ALL
+#endif
+
+#ifdef NUFS_TRACE
+
+#define TRACE(cat, level, ...) \
+    do { \
+        if (((cat) & (NUFS_TRACE_CATS)) && (level) <= (NUFS_TRACE_LEVEL)) { \
+            trace_emit((cat), (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+void trace_emit(int cat, int level, const char *fmt, ...)
+__attribute__((format(printf, 3, 4)));
+
+void trace_init(const char *path);
+
+void trace_start();
+
+void trace_stop();
+
+#else
+
+#define TRACE(cat, level, ...) do { } while (0)
+
+static inline void trace_init(const char *path) {}
+
+static inline void trace_start() {}
+
+static inline void trace_stop() {}
+
+#endif
+
+#endif
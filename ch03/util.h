@@ -4,6 +4,7 @@
 #define UTIL_H
 
 #include <string.h>
+#include <stdint.h>
 
 static int
 streq(const char *aa, const char *bb) {
@@ -26,7 +27,7 @@ clamp(int x, int v0, int v1) {
 }
 
 static int
-bytes_to_pages(int bytes) {
+bytes_to_pages(int64_t bytes) {
     int quo = bytes / 4096;
     int rem = bytes % 4096;
     if (rem == 0) {